@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+
+# Measure get-latest-version.py against the replay server, so the effect of a
+# change on the wall time, the number of external calls and the memory of a
+# run can be compared without touching Launchpad or GitHub. Every scenario is
+# a set of checker options run --runs times against a server started with the
+# given latency, each run with fresh caches unless the scenario is warm.
+
+import argparse
+import json
+import os
+import shlex
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+benchmark_dir = os.path.dirname(os.path.abspath(__file__))
+checker = os.path.join(os.path.dirname(benchmark_dir), "get-latest-version.py")
+
+# Name, checker options and whether the caches of a first run are kept for the measured ones
+default_scenarios = [
+    ("launchpad", "", False),
+    ("launchpad-jobs", "--jobs 8", False),
+    ("launchpad-snapshot", "--jobs 8 --ppa-snapshot", False),
+    ("launchpad-hedged", "--jobs 8 --ppa-snapshot --hedge-after 0.5", False),
+    ("launchpad-cached", "--jobs 8 --ppa-snapshot --query-cache {work}/query-cache.json", True),
+    ("sources-index", "--engine sources-index --ppa-snapshot --mirror {mirror}", False),
+    ("sources-index-cached", "--engine sources-index --ppa-snapshot --mirror {mirror} --index-cache {work}/index-cache", True),
+]
+
+parser = argparse.ArgumentParser(description="Benchmark get-latest-version.py against recorded responses")
+parser.add_argument("--fixtures", default=os.path.join(benchmark_dir, "fixtures"), metavar="DIR",
+    help="directory of the recorded responses (default: %(default)s)")
+parser.add_argument("--import-list", action="append", metavar="SERIES:FILE",
+    help="import list to check (default: the import lists of the fixtures)")
+parser.add_argument("--mirror-state", default="new", metavar="STATE",
+    help="state of the fixture mirror the sources-index scenarios read (default: %(default)s)")
+parser.add_argument("--scenario", action="append", metavar="NAME[=OPTIONS]",
+    help="run a default scenario, or the checker with OPTIONS, where {work} and {mirror} are replaced "
+        "by the working directory and the mirror URL (default: all the default scenarios)")
+parser.add_argument("--runs", type=int, default=3, metavar="N",
+    help="measured runs of each scenario (default: %(default)s)")
+parser.add_argument("--latency", action="append", default=[], metavar="[SERVICE=]SECONDS",
+    help="latency added by the replay server, see replay-server.py (default: 0.05)")
+parser.add_argument("--tail-latency", type=float, default=0.0, metavar="SECONDS",
+    help="extra latency of a fraction of the Launchpad answers, see replay-server.py")
+parser.add_argument("--tail-fraction", type=float, default=0.05, metavar="FRACTION",
+    help="fraction of the Launchpad answers delayed by --tail-latency (default: %(default)s)")
+parser.add_argument("--json", metavar="FILE",
+    help="also write the measures of every run to FILE")
+args = parser.parse_args()
+
+if args.runs < 1:
+    parser.error("--runs must be at least 1")
+
+scenarios = []
+for argument in args.scenario or [name for name, _, _ in default_scenarios]:
+    name, separator, options = argument.partition("=")
+    if separator:
+        scenarios.append((name, options, False))
+        continue
+    matching = [scenario for scenario in default_scenarios if scenario[0] == name]
+    if not matching:
+        parser.error("Unknown scenario `%s`" % (name))
+    scenarios += matching
+
+import_lists = args.import_list or ["%s:%s" % (series_name, os.path.join(args.fixtures, "import-lists", series_name))
+    for series_name in ["jammy", "focal"]]
+
+server_command = [sys.executable, os.path.join(benchmark_dir, "replay-server.py"), "--port", "0", "--fixtures", args.fixtures,
+    "--tail-latency", str(args.tail_latency), "--tail-fraction", str(args.tail_fraction)]
+for latency in args.latency or ["0.05"]:
+    server_command += ["--latency", latency]
+
+# A fresh server for every run, so the issues opened by a run do not change
+# what the next one finds
+def start_server():
+    server = subprocess.Popen(server_command, stdout=subprocess.PIPE, text=True)
+    return server, server.stdout.readline().split()[-1]
+
+def server_requests(server_url):
+    with urllib.request.urlopen(server_url + "_replay/stats") as response:
+        return json.load(response)["requests"]
+
+def run_checker(server_url, work_dir, options):
+    report_path = os.path.join(work_dir, "report.json")
+    environment = dict(os.environ, GITHUB_TOKEN="replay", GITHUB_REPOSITORY="elementary/os-patches")
+    command = [sys.executable, checker,
+        "--launchpad-service-root", server_url + "launchpad/",
+        "--github-api-url", server_url + "github",
+        "--cache-dir", os.path.join(work_dir, "launchpadlib-cache"),
+        "--report-json", report_path]
+    for import_list in import_lists:
+        command += ["--import-list", import_list]
+    command += shlex.split(options.format(work=work_dir, mirror=server_url + "mirror/" + args.mirror_state))
+
+    started = time.monotonic()
+    process = subprocess.Popen(command, env=environment, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    errors = process.stderr.read()
+    _, status, usage = os.wait4(process.pid, 0)
+    seconds = time.monotonic() - started
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        print(errors, file=sys.stderr)
+
+    with open(report_path) as report_file:
+        report = json.load(report_file)
+    os.remove(report_path)
+    return {
+        "exit_status": process.returncode,
+        "wall_seconds": seconds,
+        # ru_maxrss is in kilobytes on Linux
+        "peak_memory_bytes": usage.ru_maxrss * 1024,
+        "calls": {endpoint: call["count"] for endpoint, call in report["calls"].items()},
+        "requests": server_requests(server_url),
+    }
+
+def measure(name, options, warm):
+    work_dir = tempfile.mkdtemp(prefix="os-patches-benchmark-")
+    runs = []
+    try:
+        for run in range(args.runs + (1 if warm else 0)):
+            if not warm:
+                shutil.rmtree(work_dir)
+                os.makedirs(work_dir)
+            server, server_url = start_server()
+            try:
+                measures = run_checker(server_url, work_dir, options)
+            finally:
+                server.terminate()
+                server.wait()
+            # The first run of a warm scenario only fills the caches
+            if warm and run == 0:
+                continue
+            runs.append(measures)
+    finally:
+        shutil.rmtree(work_dir)
+    return runs
+
+results = {}
+print("%-22s %9s %9s %9s %9s %10s" % ("scenario", "median s", "min s", "requests", "calls", "peak MB"))
+for name, options, warm in scenarios:
+    runs = measure(name, options, warm)
+    results[name] = {"options": options, "warm": warm, "runs": runs}
+    failed = [run for run in runs if run["exit_status"] != 0]
+    print("%-22s %9.2f %9.2f %9d %9d %10.1f%s" % (name,
+        statistics.median(run["wall_seconds"] for run in runs),
+        min(run["wall_seconds"] for run in runs),
+        statistics.median(sum(run["requests"].values()) for run in runs),
+        statistics.median(sum(run["calls"].values()) for run in runs),
+        max(run["peak_memory_bytes"] for run in runs) / 1024 / 1024,
+        "  (%d failed)" % (len(failed)) if failed else ""))
+
+if args.json is not None:
+    with open(args.json, "w") as json_file:
+        json.dump(results, json_file, indent=2, sort_keys=True)
@@ -0,0 +1,410 @@
+#!/usr/bin/env python3
+
+# Check get-latest-version.py against the replay server and the recorded
+# fixtures, without any network access. Each check starts its own replay
+# server, runs the checker like the workflows do and compares the issues it
+# opened and the requests it made with what is expected. The same
+# launchpadlib, apt and PyGithub modules as for a real run are needed.
+
+import argparse
+import datetime
+import hashlib
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import urllib.request
+
+benchmark_dir = os.path.dirname(os.path.abspath(__file__))
+checker = os.path.join(os.path.dirname(benchmark_dir), "get-latest-version.py")
+fixtures = os.path.join(benchmark_dir, "fixtures")
+
+parser = argparse.ArgumentParser(description="Check get-latest-version.py against recorded responses")
+parser.add_argument("--keep", action="store_true",
+    help="keep the working directory of the checks and print its path")
+parser.add_argument("--verbose", action="store_true",
+    help="print the output of every run of the checker")
+args = parser.parse_args()
+
+# Issues the fixtures should lead to, whatever the engine
+expected_issues = {
+    "New version of packagekit available",
+    "Package `missing-package` not found in os-patches PPA",
+    "Security update of packagekit available",
+}
+
+class ReplayServer:
+    def __init__(self, *server_arguments):
+        self.process = subprocess.Popen([sys.executable, os.path.join(benchmark_dir, "replay-server.py"), "--port", "0"]
+            + list(server_arguments), stdout=subprocess.PIPE, text=True)
+        self.url = self.process.stdout.readline().split()[-1]
+
+    def stats(self):
+        with urllib.request.urlopen(self.url + "_replay/stats") as response:
+            return json.load(response)
+
+    def requests(self):
+        return self.stats()["requests"]
+
+    def created_issues(self):
+        return set(issue["title"] for issue in self.stats()["created_issues"])
+
+    def reset(self):
+        urllib.request.urlopen(urllib.request.Request(self.url + "_replay/reset", data=b"")).close()
+
+    def close(self):
+        self.process.terminate()
+        self.process.wait()
+
+work_dir = tempfile.mkdtemp(prefix="os-patches-offline-check-")
+
+default_import_lists = ["%s:%s" % (series_name, os.path.join(fixtures, "import-lists", series_name)) for series_name in ["jammy", "focal"]]
+
+def run_checker(server, name, *arguments, import_lists=default_import_lists):
+    report_path = os.path.join(work_dir, "%s.json" % (name))
+    environment = dict(os.environ, GITHUB_TOKEN="replay", GITHUB_REPOSITORY="elementary/os-patches")
+    command = [sys.executable, checker,
+        "--launchpad-service-root", server.url + "launchpad/",
+        "--github-api-url", server.url + "github",
+        "--cache-dir", os.path.join(work_dir, "launchpadlib-cache"),
+        "--report-json", report_path] + list(arguments)
+    for import_list in import_lists:
+        command += ["--import-list", import_list]
+    result = subprocess.run(command, env=environment, capture_output=True, text=True, timeout=300)
+    if args.verbose or result.returncode != 0:
+        print(result.stdout + result.stderr)
+    report = None
+    if os.path.exists(report_path):
+        with open(report_path) as report_file:
+            report = json.load(report_file)
+    return result.returncode, report
+
+failures = []
+
+def expect(check_name, description, found, wanted):
+    if found == wanted:
+        print("ok   %s: %s" % (check_name, description))
+    else:
+        print("FAIL %s: %s, found %r instead of %r" % (check_name, description, found, wanted))
+        failures.append(check_name)
+
+def sha256_file(path):
+    with open(path, "rb") as hashed_file:
+        return hashlib.sha256(hashed_file.read()).hexdigest()
+
+def read_state(state_path):
+    with open(state_path) as state_file:
+        return json.load(state_file)
+
+def write_state(state_path, state):
+    with open(state_path, "w") as state_file:
+        json.dump(state, state_file)
+
+# Rewrite the last check of every package, and of every series, in a state file
+def set_state_checks(state_path, checked, series_names=None):
+    state = read_state(state_path)
+    for state_series_name, series_state in state.items():
+        if series_names is not None and state_series_name not in series_names:
+            continue
+        series_state["since"] = checked
+        for history in series_state["history"].values():
+            history["checked"] = checked
+    write_state(state_path, state)
+
+# Packages of a state file whose last check is not `checked`, by series
+def rechecked_packages(state_path, checked):
+    return {state_series_name: sorted(entry for entry, history in series_state["history"].items() if history["checked"] != checked)
+        for state_series_name, series_state in read_state(state_path).items()}
+
+def check_launchpad_engine():
+    server = ReplayServer()
+    try:
+        returncode, _ = run_checker(server, "launchpad", "--jobs", "4", "--call-timeout", "30")
+        requests = server.requests()
+        expect("launchpad", "exit status", returncode, 0)
+        expect("launchpad", "issues opened", server.created_issues(), expected_issues)
+        expect("launchpad", "open issues listed once", requests.get("github.issues.list"), 1)
+        # One PPA lookup per entry, one fused archive lookup per package
+        expect("launchpad", "getPublishedSources requests", requests.get("launchpad.getPublishedSources"), 9)
+    finally:
+        server.close()
+
+# The first run checks every package in full and saves the state. The next
+# ones sweep the publications created in each upstream series since then,
+# and only ask the PPA about the packages found in the sweep.
+def check_incremental_state():
+    server = ReplayServer()
+    state_path = os.path.join(work_dir, "incremental-state.json")
+    focal_list = os.path.join(work_dir, "incremental-focal")
+    with open(focal_list, "w") as list_file:
+        list_file.write("gtk+3.0\n")
+    import_lists = [default_import_lists[0], "focal:" + focal_list]
+    try:
+        returncode, _ = run_checker(server, "incremental-first", "--state-file", state_path, import_lists=import_lists)
+        expect("incremental", "exit status of the first run", returncode, 0)
+        expect("incremental", "first run in full", server.requests().get("launchpad.getPublishedSources.created_since"), None)
+
+        # packagekit is added to the focal list, and gets the only full check
+        with open(focal_list, "a") as list_file:
+            list_file.write("packagekit\n")
+        opened_issues = server.created_issues()
+        server.reset()
+        returncode, _ = run_checker(server, "incremental-quiet", "--state-file", state_path, import_lists=import_lists)
+        requests = server.requests()
+        expect("incremental", "exit status of the quiet run", returncode, 0)
+        expect("incremental", "one sweep per upstream series", requests.get("launchpad.getPublishedSources.created_since"), 2)
+        # The sweeps, then the PPA and the archive for the new packagekit entry
+        expect("incremental", "archive queries of the quiet run", requests.get("launchpad.getPublishedSources"), 4)
+        expect("incremental", "issue of the new entry opened", server.created_issues() - opened_issues,
+            {"Security update of packagekit available"})
+
+        # The packagekit update of jammy was created since the last check
+        set_state_checks(state_path, "2023-06-01T00:00:00+00:00")
+        server.reset()
+        returncode, _ = run_checker(server, "incremental-changed", "--state-file", state_path, import_lists=import_lists)
+        requests = server.requests()
+        expect("incremental", "exit status of the changed run", returncode, 0)
+        expect("incremental", "swept since the last check", requests.get("launchpad.getPublishedSources.created_since"), 2)
+        expect("incremental", "PPA only asked about the swept package", requests.get("launchpad.getPublishedSources"), 3)
+
+        server.reset()
+        returncode, _ = run_checker(server, "incremental-resync", "--full-resync", "--state-file", state_path, import_lists=import_lists)
+        requests = server.requests()
+        expect("incremental", "exit status of the full resync", returncode, 0)
+        expect("incremental", "no sweep on a full resync", requests.get("launchpad.getPublishedSources.created_since"), None)
+        expect("incremental", "every package queried", requests.get("launchpad.getPublishedSources"), 9)
+    finally:
+        server.close()
+
+# With --package-budget, the packages that changed most often go first, and
+# the ones not checked for --revisit-interval are always due. A newest Ubuntu
+# version that changed is recorded in the history of the package.
+def check_package_budget():
+    server = ReplayServer()
+    state_path = os.path.join(work_dir, "budget-state.json")
+    try:
+        returncode, _ = run_checker(server, "budget-first", "--state-file", state_path)
+        expect("budget", "exit status of the first run", returncode, 0)
+
+        # packagekit changed twice in jammy, and was last checked before its update
+        recently = (datetime.datetime.now(datetime.timezone.utc) - datetime.timedelta(hours=1)).isoformat()
+        set_state_checks(state_path, recently)
+        state = read_state(state_path)
+        packagekit = state["jammy"]["history"]["packagekit:jammy"]
+        packagekit.update(newest_version="1.2.5-2ubuntu2", changes=[recently, recently])
+        write_state(state_path, state)
+        returncode, report = run_checker(server, "budget-busiest", "--state-file", state_path, "--package-budget", "1")
+        expect("budget", "exit status of the budget run", returncode, 0)
+        expect("budget", "packages left for the next runs", report["counters"].get("packages_deferred"), 5)
+        expect("budget", "busiest package checked", rechecked_packages(state_path, recently), {"jammy": ["packagekit:jammy"], "focal": []})
+
+        # The jammy packages are due for a revisit, and take the whole budget
+        long_ago = (datetime.datetime.now(datetime.timezone.utc) - datetime.timedelta(days=10)).isoformat()
+        set_state_checks(state_path, long_ago, ["jammy"])
+        state = read_state(state_path)
+        state["jammy"]["history"]["packagekit:jammy"]["checked"] = "2023-06-01T00:00:00+00:00"
+        write_state(state_path, state)
+        returncode, report = run_checker(server, "budget-revisit", "--state-file", state_path, "--package-budget", "1")
+        expect("budget", "exit status of the revisit run", returncode, 0)
+        expect("budget", "focal left for the next runs", report["counters"].get("packages_deferred"), 2)
+        expect("budget", "jammy revisited", rechecked_packages(state_path, long_ago)["jammy"],
+            ["gtk+3.0:jammy", "missing-package:jammy", "network-manager:jammy", "packagekit:jammy"])
+        packagekit = read_state(state_path)["jammy"]["history"]["packagekit:jammy"]
+        expect("budget", "new version recorded", packagekit["newest_version"], "1.2.5-2ubuntu3")
+        expect("budget", "change recorded", len(packagekit["changes"]), 3)
+    finally:
+        server.close()
+
+# Two shards leave their issues to the merge, which opens each of them once
+# and none of the ones already open. Until then, the shards do not move the
+# watermarks of the series with issues left to open.
+def check_shards():
+    server = ReplayServer()
+    def shard_paths(shard):
+        return os.path.join(work_dir, "shard-%d.json" % (shard)), os.path.join(work_dir, "shard-state-%d.json" % (shard))
+    def run_shards(name):
+        for shard in [1, 2]:
+            partial_report, state_path = shard_paths(shard)
+            returncode, _ = run_checker(server, "%s-%d" % (name, shard), "--shard", "%d/2" % (shard),
+                "--partial-report", partial_report, "--state-file", state_path)
+            expect("shards", "exit status of shard %d" % (shard), returncode, 0)
+    def watermarked_series():
+        return sorted((shard, state_series_name) for shard in [1, 2]
+            for state_series_name, series_state in read_state(shard_paths(shard)[1]).items() if "since" in series_state)
+    def merge(name):
+        returncode, _ = run_checker(server, name, "--merge-reports", shard_paths(1)[0], shard_paths(2)[0], import_lists=[])
+        expect("shards", "exit status of the %s" % (name), returncode, 0)
+    try:
+        run_shards("shards")
+        expect("shards", "no issue opened by the shards", server.requests().get("github.issues.create"), None)
+        # The packages with issues all fall in the first shard, the second
+        # one only has network-manager in jammy
+        expect("shards", "watermarks held back", watermarked_series(), [(2, "jammy")])
+
+        merge("merge")
+        expect("shards", "issues opened by the merge", server.created_issues(), expected_issues)
+        expect("shards", "each issue opened once", server.requests().get("github.issues.create"), len(expected_issues))
+
+        server.reset()
+        run_shards("shards-again")
+        expect("shards", "watermarks moved once the issues are open", watermarked_series(), [(1, "focal"), (1, "jammy"), (2, "jammy")])
+        merge("merge-again")
+        expect("shards", "open issues not opened again", server.requests().get("github.issues.create"), None)
+    finally:
+        server.close()
+
+# The index cache is filled from the old state of the mirror, then brought to
+# the new state through the pdiffs of jammy-updates only
+def check_sources_index():
+    server = ReplayServer()
+    index_cache = os.path.join(work_dir, "index-cache")
+    engine_arguments = ["--engine", "sources-index", "--index-cache", index_cache, "--ppa-snapshot",
+        "--github-cache", os.path.join(work_dir, "github-cache.json")]
+    try:
+        returncode, _ = run_checker(server, "sources-index-old", "--mirror", server.url + "mirror/old", *engine_arguments)
+        requests = server.requests()
+        expect("sources-index", "exit status", returncode, 0)
+        expect("sources-index", "indices downloaded in full", requests.get("mirror.Sources.xz"), 6)
+        expect("sources-index", "one PPA snapshot", requests.get("launchpad.getPublishedSources"), 1)
+        expect("sources-index", "issues opened from the old mirror", server.created_issues(),
+            expected_issues - {"New version of packagekit available"})
+
+        server.reset()
+        returncode, _ = run_checker(server, "sources-index-new", "--mirror", server.url + "mirror/new", *engine_arguments)
+        requests = server.requests()
+        expect("pdiff", "exit status", returncode, 0)
+        expect("pdiff", "unchanged InRelease files", requests.get("mirror.InRelease.not_modified"), 5)
+        expect("pdiff", "no index downloaded in full", requests.get("mirror.Sources.xz"), None)
+        expect("pdiff", "pdiff index and patches fetched", requests.get("mirror.Sources.diff"), 3)
+        expect("pdiff", "patched index", sha256_file(os.path.join(index_cache, "jammy-updates", "main", "Sources")),
+            sha256_file(os.path.join(fixtures, "mirror", "new", "dists", "jammy-updates", "main", "source", "Sources")))
+        expect("pdiff", "issues opened, like the launchpad engine", server.created_issues(), expected_issues)
+
+        server.reset()
+        returncode, report = run_checker(server, "sources-index-unchanged", "--mirror", server.url + "mirror/new", *engine_arguments)
+        requests = server.requests()
+        expect("unchanged", "exit status", returncode, 0)
+        expect("unchanged", "unchanged InRelease files", requests.get("mirror.InRelease.not_modified"), 6)
+        expect("unchanged", "cached indices reused", report["caches"]["sources_index_file"], {"hits": 6, "misses": 0})
+    finally:
+        server.close()
+
+# Without --index-cache, the indices are streamed and parsed as they are downloaded
+def check_streamed_sources_index():
+    server = ReplayServer()
+    try:
+        returncode, report = run_checker(server, "sources-index-streamed", "--mirror", server.url + "mirror/new",
+            "--engine", "sources-index")
+        expect("streamed", "exit status", returncode, 0)
+        expect("streamed", "indices downloaded", server.requests().get("mirror.Sources.xz"), 6)
+        # Every component is asked for, the fixture mirror only has main
+        expect("streamed", "downloads timed", report["calls"]["archive.Sources"]["count"], 24)
+        expect("streamed", "issues opened", server.created_issues(), expected_issues)
+    finally:
+        server.close()
+
+# The sources-index engine asks Launchpad when the versions it found were
+# published, once, so the patch lag is known without --backfill-history
+def check_index_publication_dates():
+    server = ReplayServer()
+    engine_arguments = ["--engine", "sources-index", "--mirror", server.url + "mirror/new", "--ppa-snapshot",
+        "--database", os.path.join(work_dir, "index-dates.db")]
+    try:
+        returncode, report = run_checker(server, "index-dates", *engine_arguments)
+        expect("index-dates", "exit status", returncode, 0)
+        # One query per version found in a series, whatever the pockets it is in
+        expect("index-dates", "dated versions", report["calls"]["launchpad.archive.getPublishedSources.dates"]["count"], 11)
+        expect("index-dates", "packagekit behind in jammy", report["patch_lag"]["packages"]["jammy"]["packagekit"]["behind_seconds"] > 0, True)
+
+        returncode, report = run_checker(server, "index-dates-again", *engine_arguments)
+        expect("index-dates", "exit status of the next run", returncode, 0)
+        expect("index-dates", "dates only asked once", "launchpad.archive.getPublishedSources.dates" in report["calls"], False)
+    finally:
+        server.close()
+
+# A pdiff the mirror fails to serve leads to a full download of the index
+def check_pdiff_failure():
+    server = ReplayServer("--error", "Sources.diff/2023-06-09-1802.11=503")
+    index_cache = os.path.join(work_dir, "index-cache-pdiff-failure")
+    engine_arguments = ["--engine", "sources-index", "--index-cache", index_cache, "--ppa-snapshot"]
+    try:
+        run_checker(server, "pdiff-failure-old", "--mirror", server.url + "mirror/old", *engine_arguments)
+        server.reset()
+        returncode, report = run_checker(server, "pdiff-failure-new", "--mirror", server.url + "mirror/new", *engine_arguments)
+        requests = server.requests()
+        expect("pdiff-failure", "exit status", returncode, 0)
+        expect("pdiff-failure", "failed pdiff", requests.get("error.503"), 1)
+        expect("pdiff-failure", "failure reported", report["counters"].get("pdiff_failures"), 1)
+        expect("pdiff-failure", "index downloaded in full instead", requests.get("mirror.Sources.xz"), 1)
+        expect("pdiff-failure", "downloaded index", sha256_file(os.path.join(index_cache, "jammy-updates", "main", "Sources")),
+            sha256_file(os.path.join(fixtures, "mirror", "new", "dists", "jammy-updates", "main", "source", "Sources")))
+        expect("pdiff-failure", "issues opened", server.created_issues(), expected_issues)
+    finally:
+        server.close()
+
+# The first package of the jammy import list does not finish before the run
+# deadline. The checks that finished meanwhile are still reported, only the
+# slow ones are skipped.
+def check_run_deadline():
+    server = ReplayServer("--slow", "source_name=gtk=5")
+    try:
+        returncode, report = run_checker(server, "run-deadline", "--jobs", "4", "--run-deadline", "3")
+        expect("run-deadline", "exit status", returncode, 0)
+        expect("run-deadline", "slow packages skipped", report["counters"].get("packages_skipped"), 2)
+        expect("run-deadline", "issues of the other packages opened", server.created_issues(), expected_issues)
+    finally:
+        server.close()
+
+# A lookup answering after --hedge-after is sent again, on a session of its
+# own, and the second answer is used. The other lookups are not hedged and
+# use the sessions of the check threads.
+def check_hedged_lookups():
+    server = ReplayServer("--slow-first", "ws.op=getPublishedSources=5")
+    try:
+        returncode, report = run_checker(server, "hedged", "--jobs", "2", "--hedge-after", "1")
+        expect("hedged", "exit status", returncode, 0)
+        expect("hedged", "one lookup hedged", report["counters"].get("hedged_requests"), 1)
+        expect("hedged", "second attempt used", report["counters"].get("hedged_requests_won"), 1)
+        # At most one session per check thread, one for the second attempt
+        # and one replacing the session still busy with the first attempt
+        expect("hedged", "sessions logged in", server.requests().get("launchpad.wadl") <= 4, True)
+        expect("hedged", "issues opened", server.created_issues(), expected_issues)
+    finally:
+        server.close()
+
+# Issue creations lost on the network fail their packages, but the other
+# issues are still opened and the run still writes its reports
+def check_github_write_failure():
+    server = ReplayServer("--error", "POST /github=drop")
+    try:
+        returncode, report = run_checker(server, "github-write-failure")
+        expect("github-write-failure", "exit status", returncode, 1)
+        # PyGithub retries each creation a few times on its own
+        expect("github-write-failure", "every creation tried", server.requests().get("error.drop", 0) >= len(expected_issues), True)
+        expect("github-write-failure", "report written", report is not None, True)
+    finally:
+        server.close()
+
+try:
+    check_launchpad_engine()
+    check_incremental_state()
+    check_package_budget()
+    check_shards()
+    check_sources_index()
+    check_streamed_sources_index()
+    check_index_publication_dates()
+    check_pdiff_failure()
+    check_github_write_failure()
+    check_run_deadline()
+    check_hedged_lookups()
+finally:
+    if args.keep:
+        print("Working directory kept in %s" % (work_dir))
+    else:
+        shutil.rmtree(work_dir)
+
+if failures:
+    print("%d check(s) failed" % (len(failures)))
+    sys.exit(1)
@@ -0,0 +1,452 @@
+#!/usr/bin/env python3
+
+# Local stand-in for the web services get-latest-version.py talks to, serving
+# recorded responses from a fixture directory:
+#
+#   /launchpad/  the Launchpad web service (--launchpad-service-root), with
+#                getPublishedSources, getSeries and getPPAByName
+#   /github/     the GitHub issues API (--github-api-url), with ETags and
+#                rate limit headers
+#   /mirror/STATE/  an Ubuntu mirror (--mirror) in one of the states of the
+#                fixture directory, with conditional InRelease requests
+#
+# The recorded bodies use the production URLs, which are rewritten to the
+# address of this server. Latency can be added to every request, and a
+# fraction of the Launchpad requests can be made much slower to reproduce the
+# tail latency hedged lookups are meant for. Chosen requests can be slowed
+# down, answered with an error or dropped. The number of requests served
+# for each endpoint is returned by /_replay/stats, and POST /_replay/reset
+# sets the counts back to zero.
+
+import argparse
+import collections
+import datetime
+import email.utils
+import gzip
+import hashlib
+import http.server
+import json
+import lzma
+import os
+import random
+import threading
+import time
+import urllib.parse
+
+parser = argparse.ArgumentParser(description="Replay recorded Launchpad, GitHub and mirror responses")
+parser.add_argument("--fixtures", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "fixtures"), metavar="DIR",
+    help="directory of the recorded responses (default: %(default)s)")
+parser.add_argument("--address", default="127.0.0.1", metavar="ADDRESS",
+    help="address to listen on (default: %(default)s)")
+parser.add_argument("--port", type=int, default=8780, metavar="PORT",
+    help="port to listen on, 0 for any free port (default: %(default)s)")
+parser.add_argument("--latency", action="append", default=[], metavar="[SERVICE=]SECONDS",
+    help="delay the answers of every service, or of launchpad, github or mirror only")
+parser.add_argument("--jitter", type=float, default=0.0, metavar="SECONDS",
+    help="add a random delay of up to SECONDS to every answer")
+parser.add_argument("--tail-latency", type=float, default=0.0, metavar="SECONDS",
+    help="delay a fraction of the Launchpad answers by SECONDS more")
+parser.add_argument("--tail-fraction", type=float, default=0.05, metavar="FRACTION",
+    help="fraction of the Launchpad answers delayed by --tail-latency (default: %(default)s)")
+parser.add_argument("--slow", action="append", default=[], metavar="TEXT=SECONDS",
+    help="delay the requests whose method, path and query, e.g. `GET /launchpad/...?ws.op=...`, contain TEXT "
+        "by SECONDS more")
+parser.add_argument("--slow-first", action="append", default=[], metavar="TEXT=SECONDS",
+    help="like --slow, but only for the first request containing TEXT")
+parser.add_argument("--error", action="append", default=[], metavar="TEXT=STATUS",
+    help="answer the requests whose method, path and query contain TEXT with the HTTP STATUS error, "
+        "or close the connection without answering when STATUS is drop")
+parser.add_argument("--github-rate-limit", type=int, default=5000, metavar="N",
+    help="GitHub requests allowed per window, refused with 403 once used up (default: %(default)s)")
+parser.add_argument("--github-rate-window", type=float, default=3600, metavar="SECONDS",
+    help="length of the GitHub rate limit window (default: %(default)s)")
+parser.add_argument("--github-page-size", type=int, default=100, metavar="N",
+    help="largest page of issues returned, to exercise the pagination (default: %(default)s)")
+parser.add_argument("--seed", type=int, default=0,
+    help="seed of the random delays (default: %(default)s)")
+args = parser.parse_args()
+
+services = ["launchpad", "github", "mirror"]
+latencies = dict.fromkeys(services, 0.0)
+for argument in args.latency:
+    service, separator, seconds = argument.rpartition("=")
+    if separator and service not in services:
+        parser.error("Unknown service `%s` in --latency" % (service))
+    for latency_service in [service] if separator else services:
+        latencies[latency_service] = float(seconds)
+
+# (text, seconds, whether only the first matching request is slowed down)
+slow_requests = []
+for option, arguments in [("--slow", args.slow), ("--slow-first", args.slow_first)]:
+    for argument in arguments:
+        text, separator, seconds = argument.rpartition("=")
+        if not separator:
+            parser.error("%s expects TEXT=SECONDS" % (option))
+        slow_requests.append((text, float(seconds), option == "--slow-first"))
+
+injected_errors = []
+for argument in args.error:
+    text, separator, status = argument.rpartition("=")
+    if not separator or not (status.isdigit() or status == "drop"):
+        parser.error("--error expects TEXT=STATUS")
+    injected_errors.append((text, status))
+
+random_delays = random.Random(args.seed)
+random_lock = threading.Lock()
+
+launchpad_production_root = "https://api.launchpad.net/"
+github_production_root = "https://api.github.com/"
+
+with open(os.path.join(args.fixtures, "launchpad", "wadl.xml")) as wadl_file:
+    launchpad_wadl = wadl_file.read()
+with open(os.path.join(args.fixtures, "launchpad", "launchpad.json")) as launchpad_file:
+    launchpad_fixtures = json.load(launchpad_file)
+with open(os.path.join(args.fixtures, "github", "issues.json")) as issues_file:
+    github_issues = json.load(issues_file)
+
+# Requests served by endpoint, and the state of the GitHub rate limit
+state_lock = threading.RLock()
+request_counts = collections.Counter()
+created_issues = []
+rate_window_start = time.time()
+rate_remaining = args.github_rate_limit
+
+def count_request(endpoint):
+    with state_lock:
+        request_counts[endpoint] += 1
+
+def delay(service):
+    seconds = latencies[service]
+    with random_lock:
+        seconds += random_delays.uniform(0, args.jitter)
+        if service == "launchpad" and random_delays.random() < args.tail_fraction:
+            seconds += args.tail_latency
+    if seconds > 0:
+        time.sleep(seconds)
+
+def parse_date(value):
+    return datetime.datetime.fromisoformat(value.replace("Z", "+00:00"))
+
+# Answer a named getPublishedSources operation with the recorded publications
+# of an archive, filtered and ordered like Launchpad does, in pages of ws.size
+def published_sources(archive_path, query):
+    entries = launchpad_fixtures["publications"].get(archive_path, [])
+    if "source_name" in query:
+        if query.get("exact_match", "false").lower() == "true":
+            entries = [entry for entry in entries if entry["source_package_name"] == query["source_name"]]
+        else:
+            entries = [entry for entry in entries if query["source_name"] in entry["source_package_name"]]
+    if "version" in query:
+        entries = [entry for entry in entries if entry["source_package_version"] == query["version"]]
+    if "status" in query:
+        entries = [entry for entry in entries if entry["status"] == query["status"]]
+    if "pocket" in query:
+        entries = [entry for entry in entries if entry["pocket"] == query["pocket"]]
+    if "distro_series" in query:
+        series_name = query["distro_series"].rstrip("/").rsplit("/", 1)[-1]
+        entries = [entry for entry in entries if entry["distro_series_link"].rstrip("/").rsplit("/", 1)[-1] == series_name]
+    if "created_since_date" in query:
+        created_since = parse_date(query["created_since_date"])
+        entries = [entry for entry in entries if parse_date(entry["date_created"]) >= created_since]
+
+    # Newest first, grouped by package unless ordered by date only
+    entries = sorted(entries, key=lambda entry: parse_date(entry["date_created"]), reverse=True)
+    if query.get("order_by_date", "false").lower() != "true":
+        entries = sorted(entries, key=lambda entry: entry["source_package_name"])
+    return entries
+
+class ReplayRequestHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def base_url(self):
+        return "http://%s/" % (self.headers.get("Host") or "%s:%d" % self.server.server_address[:2])
+
+    def rewrite(self, body):
+        return body.replace(launchpad_production_root, self.base_url() + "launchpad/") \
+            .replace(github_production_root, self.base_url() + "github/")
+
+    def send(self, status, body=b"", content_type="application/json", headers={}):
+        if isinstance(body, str):
+            body = body.encode("utf-8")
+        self.send_response(status)
+        for name, value in headers.items():
+            self.send_header(name, value)
+        if status != 304:
+            self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body) if status != 304 else 0))
+        self.end_headers()
+        if status != 304:
+            self.wfile.write(body)
+
+    def send_json(self, document, status=200, headers={}):
+        self.send(status, self.rewrite(json.dumps(document)), headers=headers)
+
+    def inject_faults(self):
+        request = "%s %s" % (self.command, self.path)
+        for slow_request in list(slow_requests):
+            text, seconds, first_only = slow_request
+            if text in request:
+                if first_only:
+                    with state_lock:
+                        if slow_request not in slow_requests:
+                            continue
+                        slow_requests.remove(slow_request)
+                time.sleep(seconds)
+        for text, status in injected_errors:
+            if text in request:
+                count_request("error.%s" % (status))
+                if status == "drop":
+                    self.close_connection = True
+                else:
+                    self.send(int(status), "Injected error", "text/plain")
+                return True
+        return False
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        query = dict(urllib.parse.parse_qsl(url.query))
+        service, _, path = url.path.lstrip("/").partition("/")
+        if service == "launchpad":
+            # launchpadlib sends the string arguments of named operations as JSON
+            query = {name: json.loads(value) if value.startswith('"') else value for name, value in query.items()}
+        if self.inject_faults():
+            return
+        if service == "_replay" and path == "stats":
+            with state_lock:
+                self.send_json({"requests": dict(request_counts), "created_issues": created_issues})
+        elif service == "launchpad":
+            delay("launchpad")
+            self.launchpad_get(path, query)
+        elif service == "github":
+            delay("github")
+            self.github_request("GET", path, query)
+        elif service == "mirror":
+            delay("mirror")
+            self.mirror_get(path)
+        else:
+            self.send(404, '{"message": "Not Found"}')
+
+    def do_POST(self):
+        url = urllib.parse.urlsplit(self.path)
+        service, _, path = url.path.lstrip("/").partition("/")
+        body = self.rfile.read(int(self.headers.get("Content-Length") or 0))
+        if self.inject_faults():
+            return
+        if service == "_replay" and path == "reset":
+            with state_lock:
+                request_counts.clear()
+            self.send_json({})
+        elif service == "github":
+            delay("github")
+            self.github_request("POST", path, {}, body)
+        else:
+            self.send(404, '{"message": "Not Found"}')
+
+    # Launchpad, only the devel version of the web service is recorded
+    def launchpad_get(self, path, query):
+        version, _, path = path.partition("/")
+        root = launchpad_production_root + version + "/"
+        if version != "devel":
+            self.send(404, "Unknown API version", "text/plain")
+            return
+
+        operation = query.get("ws.op")
+        if path == "" and "wadl" in self.headers.get("Accept", ""):
+            count_request("launchpad.wadl")
+            self.send(200, self.rewrite(launchpad_wadl), "application/vnd.sun.wadl+xml")
+        elif path == "":
+            count_request("launchpad.root")
+            self.send_json({"resource_type_link": root + "#service-root",
+                "distributions_collection_link": root + "distributions",
+                "people_collection_link": root + "people"})
+        elif path.startswith("~") and "/+archive/" not in path:
+            self.launchpad_person(root, path[1:], operation, query)
+        elif "/+archive/" in path:
+            self.launchpad_archive(root, path, operation, query)
+        elif "/" not in path:
+            self.launchpad_distribution(root, path, operation, query)
+        else:
+            distribution_name, _, series_name = path.partition("/")
+            series = launchpad_fixtures["distributions"].get(distribution_name, {}).get("series", {})
+            if series_name not in series:
+                self.send(404, "Object: %s, name: %s" % (distribution_name, series_name), "text/plain")
+                return
+            count_request("launchpad.distro_series")
+            self.send_json(self.distro_series(root, distribution_name, series_name, series[series_name]))
+
+    def distro_series(self, root, distribution_name, series_name, version):
+        return {"self_link": "%s%s/%s" % (root, distribution_name, series_name), "resource_type_link": root + "#distro_series",
+            "name": series_name, "version": version}
+
+    def archive(self, root, archive_path, name):
+        return {"self_link": root + archive_path, "resource_type_link": root + "#archive", "name": name}
+
+    def launchpad_person(self, root, name, operation, query):
+        person = launchpad_fixtures["people"].get(name)
+        if person is None:
+            self.send(404, "Object: <PersonSet>, name: '~%s'" % (name), "text/plain")
+        elif operation == "getPPAByName":
+            count_request("launchpad.getPPAByName")
+            distribution_name = query.get("distribution", "ubuntu").rstrip("/").rsplit("/", 1)[-1]
+            if person["ppas"].get(query.get("name")) != distribution_name:
+                self.send(404, "No such ppa: '%s'." % (query.get("name")), "text/plain")
+                return
+            self.send_json(self.archive(root, "~%s/+archive/%s/%s" % (name, distribution_name, query["name"]), query["name"]))
+        elif operation is None:
+            count_request("launchpad.person")
+            self.send_json({"self_link": "%s~%s" % (root, name), "resource_type_link": root + ("#team" if person["is_team"] else "#person"),
+                "name": name, "display_name": person["display_name"]})
+        else:
+            self.send(400, "No such operation: %s" % (operation), "text/plain")
+
+    def launchpad_distribution(self, root, name, operation, query):
+        distribution = launchpad_fixtures["distributions"].get(name)
+        if distribution is None:
+            self.send(404, "Object: <DistributionSet>, name: '%s'" % (name), "text/plain")
+        elif operation == "getSeries":
+            count_request("launchpad.getSeries")
+            for series_name, version in distribution["series"].items():
+                if query.get("name_or_version") in [series_name, version]:
+                    self.send_json(self.distro_series(root, name, series_name, version))
+                    return
+            self.send(404, "No such distribution series: '%s'." % (query.get("name_or_version")), "text/plain")
+        elif operation is None:
+            count_request("launchpad.distribution")
+            self.send_json({"self_link": root + name, "resource_type_link": root + "#distribution", "name": name,
+                "main_archive_link": "%s%s/+archive/%s" % (root, name, distribution["main_archive"])})
+        else:
+            self.send(400, "No such operation: %s" % (operation), "text/plain")
+
+    def launchpad_archive(self, root, archive_path, operation, query):
+        if archive_path not in launchpad_fixtures["publications"]:
+            self.send(404, "No such archive: '%s'." % (archive_path), "text/plain")
+        elif operation == "getPublishedSources":
+            count_request("launchpad.getPublishedSources")
+            # The incremental queries are counted on their own too
+            if "created_since_date" in query:
+                count_request("launchpad.getPublishedSources.created_since")
+            entries = published_sources(archive_path, query)
+            size = int(query.get("ws.size", 75))
+            start = int(query.get("ws.start", 0))
+            collection = {"total_size": len(entries), "start": start, "entries": entries[start:start + size]}
+            if start + size < len(entries):
+                query["ws.start"] = start + size
+                collection["next_collection_link"] = "%s%s?%s" % (root, archive_path, urllib.parse.urlencode(query))
+            self.send_json(collection)
+        elif operation is None:
+            count_request("launchpad.archive")
+            self.send_json(self.archive(root, archive_path, archive_path.rsplit("/", 1)[-1]))
+        else:
+            self.send(400, "No such operation: %s" % (operation), "text/plain")
+
+    # GitHub, every response carries the rate limit headers. Conditional
+    # requests answered with 304 are not counted against the limit, like on
+    # GitHub.
+    def github_request(self, method, path, query, body=None):
+        global rate_window_start, rate_remaining
+        parts = path.split("/")
+        not_modified = False
+        if len(parts) != 4 or parts[0] != "repos" or parts[3] != "issues":
+            self.send(404, '{"message": "Not Found"}')
+            return
+
+        if method == "GET":
+            issues = [issue for issue in github_issues + created_issues
+                if issue["state"] == query.get("state", "open")
+                and ("creator" not in query or issue["user"]["login"] == query["creator"])
+                and ("labels" not in query or set(query["labels"].split(",")) <= set(label["name"] for label in issue["labels"]))]
+            issues.sort(key=lambda issue: issue["number"], reverse=True)
+            size = min(int(query.get("per_page", 30)), args.github_page_size)
+            page = int(query.get("page", 1))
+            document = issues[(page - 1) * size:page * size]
+            etag = '"%s"' % (hashlib.sha256(json.dumps(document, sort_keys=True).encode()).hexdigest()[:32])
+            headers = {"ETag": etag}
+            if page * size < len(issues):
+                query["page"] = page + 1
+                headers["Link"] = '<%sgithub/%s?%s>; rel="next"' % (self.base_url(), path, urllib.parse.urlencode(query))
+            not_modified = self.headers.get("If-None-Match") == etag
+
+        with state_lock:
+            if time.time() - rate_window_start >= args.github_rate_window:
+                rate_window_start, rate_remaining = time.time(), args.github_rate_limit
+            rate_headers = {"X-RateLimit-Limit": str(args.github_rate_limit),
+                "X-RateLimit-Reset": str(int(rate_window_start + args.github_rate_window))}
+            if rate_remaining <= 0:
+                count_request("github.rate_limited")
+                rate_headers["X-RateLimit-Remaining"] = "0"
+                self.send(403, '{"message": "API rate limit exceeded"}', headers=rate_headers)
+                return
+            if method == "GET" and not_modified:
+                count_request("github.issues.list.not_modified")
+            else:
+                rate_remaining -= 1
+                count_request("github.issues.list" if method == "GET" else "github.issues.create")
+            rate_headers["X-RateLimit-Remaining"] = str(rate_remaining)
+
+            if method == "POST":
+                request = json.loads(body)
+                number = max(issue["number"] for issue in github_issues + created_issues) + 1
+                issue = {"url": "%srepos/%s/%s/issues/%d" % (github_production_root, parts[1], parts[2], number),
+                    "html_url": "https://github.com/%s/%s/issues/%d" % (parts[1], parts[2], number),
+                    "number": number, "title": request["title"], "body": request.get("body"), "state": "open",
+                    "user": {"login": "github-actions[bot]", "type": "Bot"},
+                    "labels": [{"name": label, "color": "ededed"} for label in request.get("labels", [])],
+                    "created_at": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+                    "updated_at": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime())}
+                created_issues.append(issue)
+                self.send_json(issue, 201, rate_headers)
+                return
+
+        rate_headers.update(headers)
+        if not_modified:
+            self.send(304, headers=rate_headers)
+        else:
+            self.send_json(document, headers=rate_headers)
+
+    # Mirror files are kept uncompressed in the fixtures, and compressed when
+    # a Sources.xz index or a .gz pdiff is asked for. An InRelease file is
+    # dated from its Date field, so conditional requests work whatever the
+    # modification times of the checkout.
+    def mirror_get(self, path):
+        file_path = os.path.normpath(os.path.join(args.fixtures, "mirror", path))
+        if not file_path.startswith(os.path.join(args.fixtures, "mirror") + os.sep):
+            self.send(404, "Not Found", "text/plain")
+            return
+        compress = None
+        for suffix, compressor in [(".xz", lzma.compress), (".gz", gzip.compress)]:
+            if file_path.endswith(suffix) and not os.path.exists(file_path):
+                file_path, compress = file_path[:-len(suffix)], compressor
+        if not os.path.isfile(file_path):
+            count_request("mirror.missing")
+            self.send(404, "Not Found", "text/plain")
+            return
+
+        with open(file_path, "rb") as mirror_file:
+            content = mirror_file.read()
+        endpoint = "mirror." + ("Sources.diff" if "/Sources.diff/" in path else os.path.basename(path))
+        headers = {}
+        if os.path.basename(path) == "InRelease":
+            for line in content.decode("utf-8", errors="replace").splitlines():
+                if line.startswith("Date:"):
+                    modified = email.utils.parsedate_to_datetime(line[len("Date:"):].strip().replace("UTC", "+0000"))
+                    headers["Last-Modified"] = email.utils.format_datetime(modified, usegmt=True)
+                    since = self.headers.get("If-Modified-Since")
+                    if since is not None and email.utils.parsedate_to_datetime(since) >= modified:
+                        count_request(endpoint + ".not_modified")
+                        self.send(304, headers=headers)
+                        return
+                    break
+        count_request(endpoint)
+        self.send(200, compress(content) if compress is not None else content, "application/octet-stream", headers)
+
+    def log_message(self, format, *log_arguments):
+        pass
+
+server = http.server.ThreadingHTTPServer((args.address, args.port), ReplayRequestHandler)
+server.daemon_threads = True
+# The port is printed first, so a harness starting the server with --port 0 can read it
+print("Replaying on http://%s:%d/" % server.server_address[:2], flush=True)
+try:
+    server.serve_forever()
+except KeyboardInterrupt:
+    pass
@@ -1,92 +1,2154 @@
 #!/usr/bin/env python3
 
+import argparse
+import collections
+import contextlib
+import datetime
+import email.utils
+import functools
+import gzip
+import hashlib
+import http.client
+import http.server
+import io
+import json
+import lzma
+import math
 import os
+import resource
+import shutil
+import sqlite3
 import sys
+import threading
+import time
+import traceback
+import urllib.error
+import urllib.parse
+import urllib.request
+from concurrent.futures import FIRST_COMPLETED, CancelledError, ThreadPoolExecutor, wait
+from concurrent.futures import TimeoutError as FutureTimeoutError
 import apt_pkg
 from launchpadlib.launchpad import Launchpad
-from github import Github
+from github import Github, GithubException
+import requests
 
 default_series_name = "bionic"
 
+# A shard is given as INDEX/COUNT, the index starting at 1
+def parse_shard(argument):
+    index, _, count = argument.partition("/")
+    try:
+        index, count = int(index), int(count)
+    except ValueError:
+        raise argparse.ArgumentTypeError("expected INDEX/COUNT, got `%s`" % (argument))
+    if not 1 <= index <= count:
+        raise argparse.ArgumentTypeError("the shard index must be between 1 and the shard count")
+    return index, count
+
 # Process the command line arguments
-if len(sys.argv) < 2:
-    raise ValueError("Please provide a package name")
+parser = argparse.ArgumentParser(
+    description="Check that the packages in os-patches are up to date with Ubuntu")
+parser.add_argument("package", nargs="?",
+    help="name of the source package to check")
+parser.add_argument("series", nargs="?",
+    help="Ubuntu series the package is patched for (default: %s)" % default_series_name)
+parser.add_argument("upstream_series", nargs="?",
+    help="Ubuntu series to look for new versions in (default: the patched series)")
+parser.add_argument("-l", "--import-list", action="append", metavar="[SERIES:]FILE",
+    help="check every package listed in FILE, one `package[:upstream_series]` per line, for SERIES "
+        "(default: --series); can be given once per series to check them all in one run")
+parser.add_argument("-s", "--series", dest="series_option", metavar="SERIES",
+    help="Ubuntu series the packages are patched for, same as the positional argument")
+parser.add_argument("-j", "--jobs", type=int, default=1, metavar="N",
+    help="number of Launchpad queries to run in parallel (default: 1)")
+parser.add_argument("--security-only", action="store_true",
+    help="only look for new versions in the Security pocket, a cheap check that can run more often")
+parser.add_argument("--shard", type=parse_shard, metavar="INDEX/COUNT",
+    help="only check the packages of the import lists that fall in shard INDEX out of COUNT")
+parser.add_argument("--partial-report", metavar="FILE",
+    help="write the issues to open, the failed packages and the timings of the run to FILE "
+        "instead of opening the issues, for --merge-reports")
+parser.add_argument("--merge-reports", nargs="+", metavar="FILE",
+    help="open the issues found by the runs that wrote the partial reports FILE, each title once, "
+        "and combine their timings in --report-json and --report-prometheus")
+parser.add_argument("--engine", choices=["launchpad", "sources-index"], default="launchpad",
+    help="find the Ubuntu versions with one Launchpad query per package (launchpad) or by "
+        "reading the Sources indices of the archive once per series (sources-index) (default: %(default)s)")
+parser.add_argument("--mirror", default="http://archive.ubuntu.com/ubuntu", metavar="URL",
+    help="Ubuntu mirror the sources-index engine reads, can be a file:// URL (default: %(default)s)")
+parser.add_argument("--query-cache", metavar="FILE",
+    help="share the Ubuntu versions found by the launchpad engine with the next runs through FILE")
+parser.add_argument("--query-cache-ttl", type=int, default=6 * 60 * 60, metavar="SECONDS",
+    help="how long the versions of --query-cache can be reused (default: %(default)s)")
+parser.add_argument("--ppa-snapshot", action="store_true",
+    help="fetch every published source of the os-patches PPA in one paged query instead of one query per package")
+parser.add_argument("--index-cache", metavar="DIR",
+    help="keep the Sources indices read by the sources-index engine in DIR, only downloading them "
+        "again when InRelease changes, and then through the pdiffs of the archive when possible")
+parser.add_argument("--state-file", metavar="FILE",
+    help="remember the last successful run in FILE and only fetch the Ubuntu publications created since then")
+parser.add_argument("--full-resync", action="store_true",
+    help="check every package in full even if --state-file has a previous run")
+parser.add_argument("--package-budget", type=int, metavar="N",
+    help="with --state-file, check at most N packages per run, the ones that changed most often in the "
+        "past first, besides the packages due for --revisit-interval")
+parser.add_argument("--revisit-interval", type=float, default=7, metavar="DAYS",
+    help="with --package-budget, check every package at least once every DAYS (default: %(default)s)")
+parser.add_argument("--database", metavar="FILE",
+    help="record every publication seen and the outcome of every run in the SQLite database FILE")
+parser.add_argument("--backfill-history", action="store_true",
+    help="before checking, record the whole publishing history of the PPA and of the checked packages in --database, "
+        "for the patch lag metrics")
+parser.add_argument("--changes-since", metavar="DATE|Nd|Nh",
+    help="list the publications --database first saw since DATE, or in the last N days or hours, "
+        "without checking anything")
+parser.add_argument("--cache-dir", default="~/.launchpadlib/cache/", metavar="DIR",
+    help="directory of the launchpadlib HTTP cache (default: %(default)s)")
+parser.add_argument("--cache-max-size", type=int, metavar="MB",
+    help="evict the least recently used entries of the launchpadlib cache above this size")
+parser.add_argument("--launchpad-service-root", default="production", metavar="URL",
+    help="Launchpad web service to query, e.g. a local server replaying recorded responses (default: %(default)s)")
+parser.add_argument("--github-api-url", default="https://api.github.com", metavar="URL",
+    help="GitHub API to open issues on (default: %(default)s)")
+parser.add_argument("--github-max-wait", type=float, default=600, metavar="SECONDS",
+    help="longest total time the run may wait for the GitHub rate limit to reset (default: %(default)s)")
+parser.add_argument("--github-reserve", type=int, default=50, metavar="N",
+    help="start spacing GitHub requests out until the rate limit resets once fewer than N remain (default: %(default)s)")
+parser.add_argument("--github-cache", metavar="FILE",
+    help="keep the ETag and Last-Modified of the GitHub issue listings in FILE, so unchanged pages "
+        "come back as 304 responses that do not count against the rate limit")
+parser.add_argument("--issue-lookup", choices=["index", "labels"], default="index",
+    help="find already opened issues by listing all the open bot issues once (index) "
+        "or with one label-filtered query per package (labels) (default: %(default)s)")
+parser.add_argument("--call-timeout", type=float, default=60, metavar="SECONDS",
+    help="give up on a Launchpad, GitHub or mirror request after SECONDS without an answer (default: %(default)s)")
+parser.add_argument("--run-deadline", type=float, metavar="SECONDS",
+    help="stop checking packages SECONDS after the start of the run and report the ones checked so far")
+parser.add_argument("--hedge-after", type=float, metavar="SECONDS",
+    help="send a second Launchpad lookup when the first one has not answered after SECONDS, "
+        "and use whichever answers first")
+parser.add_argument("--daemon-interval", type=float, metavar="SECONDS",
+    help="keep running and check the packages again every SECONDS, reusing the Launchpad sessions and series")
+parser.add_argument("--status-port", type=int, metavar="PORT",
+    help="with --daemon-interval, serve the latest result of every package as JSON on PORT")
+parser.add_argument("--status-address", default="127.0.0.1", metavar="ADDRESS",
+    help="address --status-port listens on (default: %(default)s)")
+parser.add_argument("--stats", action="store_true",
+    help="print the wall time, peak memory and external call counts of the run on stderr")
+parser.add_argument("--report-json", metavar="FILE",
+    help="write the timings and counters of the run to FILE as JSON")
+parser.add_argument("--report-prometheus", metavar="FILE",
+    help="write the timings and counters of the run to FILE in the Prometheus textfile format")
+args = parser.parse_args()
 
-if len(sys.argv) < 3:
-    series_name = default_series_name
-else:
-    series_name = sys.argv[2]
+series_name = args.series_option or args.series or default_series_name
+
+if args.changes_since is not None and args.database is None:
+    parser.error("--changes-since requires --database")
+
+if args.backfill_history and args.database is None:
+    parser.error("--backfill-history requires --database")
+
+if args.import_list is None and not args.package and args.merge_reports is None and args.changes_since is None:
+    parser.error("Please provide a package name or an import list")
+
+if args.merge_reports is not None and (args.import_list is not None or args.package):
+    parser.error("--merge-reports does not check packages itself")
+
+if args.shard is not None and args.import_list is None:
+    parser.error("--shard requires --import-list")
+
+if args.daemon_interval is not None and (args.import_list is None or args.merge_reports is not None):
+    parser.error("--daemon-interval requires --import-list")
+
+if args.status_port is not None and args.daemon_interval is None:
+    parser.error("--status-port requires --daemon-interval")
+
+if args.jobs < 1:
+    parser.error("--jobs must be at least 1")
+
+if args.call_timeout <= 0:
+    parser.error("--call-timeout must be positive")
+
+# The watermark covers a whole import list, so it cannot be moved by a single package
+if args.state_file is not None and args.import_list is None:
+    parser.error("--state-file requires --import-list")
+
+if args.package_budget is not None and args.state_file is None:
+    parser.error("--package-budget requires --state-file")
+
+# Read the list of packages to check for a series as (series, package, upstream series)
+def read_import_list(list_series_name, path):
+    packages = []
+    with open(path) as import_list:
+        for line in import_list:
+            line = line.strip()
+            if not line or line.startswith("#"):
+                continue
+            component_name, _, upstream_series_name = line.partition(":")
+            packages.append((list_series_name, component_name.strip(), upstream_series_name.strip() or list_series_name))
+    return packages
 
-if not series_name:
-    series_name = default_series_name
+# An import list is given as FILE or SERIES:FILE
+def parse_import_list_argument(argument):
+    list_series_name, separator, path = argument.partition(":")
+    if not separator or "/" in list_series_name:
+        return series_name, argument
+    return list_series_name, path
 
-if len(sys.argv) < 4:
-    upstream_series_name = series_name
+if args.import_list is not None:
+    packages = []
+    for argument in args.import_list:
+        packages += read_import_list(*parse_import_list_argument(argument))
+elif args.package:
+    packages = [(series_name, args.package, args.upstream_series or series_name)]
 else:
-    upstream_series_name = sys.argv[3]
+    packages = []
+
+# Packages are split between the shards by a hash of their name, so a shard
+# always gets the same packages and a package listed for several series is
+# checked by a single shard
+def package_shard(component_name, shard_count):
+    return int(hashlib.sha256(component_name.encode("utf-8")).hexdigest(), 16) % shard_count + 1
+
+if args.shard is not None:
+    shard_index, shard_count = args.shard
+    packages = [package for package in packages if package_shard(package[1], shard_count) == shard_index]
+
+# Series checked by this run, in the order they were given
+series_names = list(dict.fromkeys(package_series_name for package_series_name, _, _ in packages))
+
+# The state file keeps, for every series, the start of the last successful
+# run and the import list it checked. Packages checked by that run only need
+# the Ubuntu publications created since then; new entries get a full check.
+# The watermark is moved back a bit to catch publications that were still
+# pending when the last run looked at the archive.
+watermark_overlap = datetime.timedelta(days=1)
+run_started = datetime.datetime.now(datetime.timezone.utc)
+run_started_clock = time.monotonic()
+
+def read_state():
+    if args.state_file is None or not os.path.exists(args.state_file):
+        return {}
+    with open(args.state_file) as state_file:
+        return json.load(state_file)
+
+def write_state(state):
+    with open(args.state_file + ".new", "w") as state_file:
+        json.dump(state, state_file, indent=2, sort_keys=True)
+    os.replace(args.state_file + ".new", args.state_file)
+
+state = read_state()
+incremental_since = {}
+incremental_packages = {}
+incremental_history = {}
+
+# The state of a series, unless it was saved by a run searching other pockets,
+# which did not look at the same publications
+def previous_series_state(state_series_name):
+    series_state = state.get(state_series_name, {})
+    if series_state.get("pockets", all_pockets) != pockets:
+        return {}
+    return series_state
+
+def load_incremental_state():
+    incremental_since.clear()
+    incremental_packages.clear()
+    incremental_history.clear()
+    if args.full_resync:
+        return
+    for state_series_name in series_names:
+        series_state = previous_series_state(state_series_name)
+        if "since" in series_state:
+            incremental_since[state_series_name] = datetime.datetime.fromisoformat(series_state["since"]) - watermark_overlap
+            incremental_packages[state_series_name] = set(series_state["packages"])
+        incremental_history[state_series_name] = series_state.get("history", {})
+
+# Every package also keeps its own history: when it was first and last checked,
+# the newest Ubuntu version found and when that version changed. The last check
+# of a package is its watermark, as a package left out by --package-budget is
+# not checked when the watermark of its series moves.
+history_max_changes = 20
+
+def last_package_check(package_series_name, entry):
+    history = incremental_history.get(package_series_name, {}).get(entry)
+    if history is not None:
+        return datetime.datetime.fromisoformat(history["checked"])
+    if entry in incremental_packages.get(package_series_name, ()):
+        return incremental_since[package_series_name] + watermark_overlap
+    return None
+
+def incremental_check_since(package_series_name, entry):
+    last_check = last_package_check(package_series_name, entry)
+    if last_check is None:
+        return None
+    return last_check - watermark_overlap
+
+def updated_history(state_series_name, series_entries, checked_versions):
+    previous = previous_series_state(state_series_name)
+    history = previous.get("history", {})
+    updated = {}
+    for entry in series_entries:
+        package = history.get(entry)
+        if package is None and entry in previous.get("packages", []):
+            package = {"first_checked": previous["since"], "checked": previous["since"], "newest_version": None, "changes": []}
+        if entry in checked_versions:
+            now = run_started.isoformat()
+            package = dict(package or {"first_checked": now, "newest_version": None, "changes": []}, checked=now)
+            newest_version = checked_versions[entry]
+            if newest_version is not None:
+                if package["newest_version"] is not None and newest_version != package["newest_version"]:
+                    package["changes"] = (package["changes"] + [now])[-history_max_changes:]
+                package["newest_version"] = newest_version
+        if package is not None:
+            updated[entry] = package
+    return updated
+
+def import_list_entry(component_name, upstream_series_name):
+    return "%s:%s" % (component_name, upstream_series_name)
+
+# Timings and counters of the external calls, caches and packages of the run
+class RunMetrics:
+    latency_buckets = [0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30]
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.current = threading.local()
+        self.calls = {}
+        self.caches = {}
+        self.packages = {}
+        self.counters = {}
+        self.shards = {}
+        self.github_budget = None
+        self.patch_lag = None
+
+    # Time an external call, counting it for the package being checked
+    @contextlib.contextmanager
+    def call(self, endpoint):
+        started = time.monotonic()
+        failed = False
+        try:
+            yield
+        except Exception:
+            failed = True
+            raise
+        finally:
+            duration = time.monotonic() - started
+            with self.lock:
+                call = self.calls.setdefault(endpoint, {"count": 0, "errors": 0, "seconds": 0.0,
+                    "buckets": [0] * len(self.latency_buckets)})
+                call["count"] += 1
+                call["errors"] += failed
+                call["seconds"] += duration
+                for index, bound in enumerate(self.latency_buckets):
+                    if duration <= bound:
+                        call["buckets"][index] += 1
+                package = getattr(self.current, "package", None)
+                if package is not None:
+                    package["calls"] += 1
+
+    def package_failed(self, package_series_name, name):
+        with self.lock:
+            self.package_totals(package_series_name, name)["failed"] = True
+
+    def package_skipped(self, package_series_name, name):
+        with self.lock:
+            self.package_totals(package_series_name, name)["skipped"] = True
+
+    def count(self, name):
+        with self.lock:
+            self.counters[name] = self.counters.get(name, 0) + 1
+
+    def cache(self, name, hit):
+        with self.lock:
+            cache = self.caches.setdefault(name, {"hits": 0, "misses": 0})
+            cache["hits" if hit else "misses"] += 1
+
+    def package_totals(self, package_series_name, name):
+        return self.packages.setdefault(package_series_name, {}).setdefault(name, {"calls": 0, "seconds": 0.0, "failed": False, "skipped": False})
+
+    # Account the time spent and the calls made within the block to a package
+    @contextlib.contextmanager
+    def package(self, package_series_name, name):
+        with self.lock:
+            totals = self.package_totals(package_series_name, name)
+        self.current.package = totals
+        started = time.monotonic()
+        try:
+            yield
+        finally:
+            self.current.package = None
+            with self.lock:
+                totals["seconds"] += time.monotonic() - started
+
+    # Add the timings and counters of a partial report to the ones of this run
+    def merge(self, shard, report):
+        with self.lock:
+            self.shards[shard] = {"seconds": report["seconds"], "peak_memory_bytes": report["peak_memory_bytes"]}
+            for endpoint, shard_call in report["calls"].items():
+                call = self.calls.setdefault(endpoint, {"count": 0, "errors": 0, "seconds": 0.0,
+                    "buckets": [0] * len(self.latency_buckets)})
+                for key in ["count", "errors", "seconds"]:
+                    call[key] += shard_call[key]
+                call["buckets"] = [count + shard_count for count, shard_count in zip(call["buckets"], shard_call["buckets"])]
+            for name, shard_cache in report["caches"].items():
+                cache = self.caches.setdefault(name, {"hits": 0, "misses": 0})
+                cache["hits"] += shard_cache["hits"]
+                cache["misses"] += shard_cache["misses"]
+            for name, count in report["counters"].items():
+                self.counters[name] = self.counters.get(name, 0) + count
+            for package_series_name, series_packages in report["packages"].items():
+                self.packages.setdefault(package_series_name, {}).update(series_packages)
+            if report.get("patch_lag") is not None:
+                package_lags = self.patch_lag["packages"] if self.patch_lag is not None else {}
+                for lag_series_name, series_packages in report["patch_lag"]["packages"].items():
+                    package_lags.setdefault(lag_series_name, {}).update(series_packages)
+                self.patch_lag = {"series": patch_lag_summary(package_lags), "packages": package_lags}
+
+    def sorted_packages(self):
+        for package_series_name, series_packages in sorted(self.packages.items()):
+            for name, package in sorted(series_packages.items()):
+                yield package_series_name, name, package
+
+    def report(self):
+        return {
+            "series": series_names,
+            "started": run_started.isoformat(),
+            "seconds": time.monotonic() - run_started_clock,
+            # ru_maxrss is in kilobytes on Linux
+            "peak_memory_bytes": resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024,
+            "latency_buckets": self.latency_buckets,
+            "calls": self.calls,
+            "caches": self.caches,
+            "packages": self.packages,
+            "counters": self.counters,
+            "shards": self.shards,
+            "github_budget": self.github_budget,
+            "patch_lag": self.patch_lag,
+        }
+
+    def prometheus_report(self):
+        def label(value):
+            return str(value).replace("\\", "\\\\").replace('"', '\\"').replace("\n", "\\n")
+
+        report = self.report()
+        prefix = "os_patches_checker_"
+        lines = [
+            "# HELP %srun_duration_seconds Wall time of the run" % prefix,
+            "# TYPE %srun_duration_seconds gauge" % prefix,
+            "%srun_duration_seconds %f" % (prefix, report["seconds"]),
+            "# HELP %srun_peak_memory_bytes Peak resident memory of the run" % prefix,
+            "# TYPE %srun_peak_memory_bytes gauge" % prefix,
+            "%srun_peak_memory_bytes %d" % (prefix, report["peak_memory_bytes"]),
+            "# HELP %scall_duration_seconds Latency of the external calls" % prefix,
+            "# TYPE %scall_duration_seconds histogram" % prefix,
+        ]
+        for endpoint, call in sorted(self.calls.items()):
+            labels = 'endpoint="%s"' % label(endpoint)
+            for bound, count in zip(self.latency_buckets, call["buckets"]):
+                lines.append('%scall_duration_seconds_bucket{%s,le="%s"} %d' % (prefix, labels, bound, count))
+            lines.append('%scall_duration_seconds_bucket{%s,le="+Inf"} %d' % (prefix, labels, call["count"]))
+            lines.append("%scall_duration_seconds_sum{%s} %f" % (prefix, labels, call["seconds"]))
+            lines.append("%scall_duration_seconds_count{%s} %d" % (prefix, labels, call["count"]))
+        if self.shards:
+            lines += [
+                "# HELP %sshard_duration_seconds Wall time of the sharded runs" % prefix,
+                "# TYPE %sshard_duration_seconds gauge" % prefix,
+            ]
+            for shard, shard_report in sorted(self.shards.items()):
+                lines.append('%sshard_duration_seconds{shard="%s"} %f' % (prefix, label(shard), shard_report["seconds"]))
+        lines += [
+            "# HELP %scall_errors_total External calls that failed" % prefix,
+            "# TYPE %scall_errors_total counter" % prefix,
+        ]
+        for endpoint, call in sorted(self.calls.items()):
+            lines.append('%scall_errors_total{endpoint="%s"} %d' % (prefix, label(endpoint), call["errors"]))
+        lines += [
+            "# HELP %scache_requests_total Cache lookups by result" % prefix,
+            "# TYPE %scache_requests_total counter" % prefix,
+        ]
+        for name, cache in sorted(self.caches.items()):
+            for key, result in [("hits", "hit"), ("misses", "miss")]:
+                lines.append('%scache_requests_total{cache="%s",result="%s"} %d' % (prefix, label(name), result, cache[key]))
+        lines += [
+            "# HELP %sevents_total Hedged requests sent and won, packages skipped at the run deadline" % prefix,
+            "# TYPE %sevents_total counter" % prefix,
+        ]
+        for name, count in sorted(self.counters.items()):
+            lines.append('%sevents_total{event="%s"} %d' % (prefix, label(name), count))
+        if self.github_budget is not None:
+            for name, key, help_text in [
+                    ("github_rate_limit", "limit", "GitHub requests allowed per rate limit window"),
+                    ("github_rate_limit_remaining", "remaining", "GitHub requests left at the end of the run"),
+                    ("github_rate_limit_reset_timestamp", "reset", "When the GitHub rate limit window resets"),
+                    ("github_rate_limit_waited_seconds", "waited_seconds", "Time spent waiting for the GitHub rate limit"),
+                    ("github_rate_limit_retries", "retries", "GitHub requests retried after hitting the rate limit")]:
+                lines += [
+                    "# HELP %s%s %s" % (prefix, name, help_text),
+                    "# TYPE %s%s gauge" % (prefix, name),
+                    "%s%s %f" % (prefix, name, self.github_budget[key] or 0),
+                ]
+        if self.patch_lag is not None:
+            lines += [
+                "# HELP %spatch_lag_seconds Time from an Ubuntu publication to the os-patches rebase on it" % prefix,
+                "# TYPE %spatch_lag_seconds summary" % prefix,
+            ]
+            for lag_series_name, summary in sorted(self.patch_lag["series"].items()):
+                for quantile, lag in sorted(summary["quantiles"].items()):
+                    lines.append('%spatch_lag_seconds{series="%s",quantile="%s"} %f' % (prefix, label(lag_series_name), quantile, lag))
+                lines.append('%spatch_lag_seconds_sum{series="%s"} %f' % (prefix, label(lag_series_name), summary["sum"]))
+                lines.append('%spatch_lag_seconds_count{series="%s"} %d' % (prefix, label(lag_series_name), summary["count"]))
+            lines += [
+                "# HELP %spackages_behind Packages whose newest Ubuntu version is not rebased yet" % prefix,
+                "# TYPE %spackages_behind gauge" % prefix,
+            ]
+            for lag_series_name, summary in sorted(self.patch_lag["series"].items()):
+                lines.append('%spackages_behind{series="%s"} %d' % (prefix, label(lag_series_name), summary["behind"]))
+            lines += [
+                "# HELP %spackage_behind_seconds Time since the first Ubuntu version newer than the PPA was published" % prefix,
+                "# TYPE %spackage_behind_seconds gauge" % prefix,
+            ]
+            for lag_series_name, series_packages in sorted(self.patch_lag["packages"].items()):
+                for name, package in sorted(series_packages.items()):
+                    lines.append('%spackage_behind_seconds{series="%s",package="%s"} %f' % (prefix, label(lag_series_name), label(name), package["behind_seconds"]))
+            lines += [
+                "# HELP %spackage_last_patch_lag_seconds Patch lag of the last rebase of a package" % prefix,
+                "# TYPE %spackage_last_patch_lag_seconds gauge" % prefix,
+            ]
+            for lag_series_name, series_packages in sorted(self.patch_lag["packages"].items()):
+                for name, package in sorted(series_packages.items()):
+                    if package["rebase_lags_seconds"]:
+                        lines.append('%spackage_last_patch_lag_seconds{series="%s",package="%s"} %f' % (prefix, label(lag_series_name), label(name), package["rebase_lags_seconds"][-1]))
+        lines += [
+            "# HELP %spackage_duration_seconds Time spent checking a package" % prefix,
+            "# TYPE %spackage_duration_seconds gauge" % prefix,
+        ]
+        for package_series_name, name, package in self.sorted_packages():
+            lines.append('%spackage_duration_seconds{series="%s",package="%s"} %f' % (prefix, label(package_series_name), label(name), package["seconds"]))
+        lines += [
+            "# HELP %spackage_calls External calls made to check a package" % prefix,
+            "# TYPE %spackage_calls gauge" % prefix,
+        ]
+        for package_series_name, name, package in self.sorted_packages():
+            lines.append('%spackage_calls{series="%s",package="%s"} %d' % (prefix, label(package_series_name), label(name), package["calls"]))
+        lines += [
+            "# HELP %spackage_failed Whether checking a package failed" % prefix,
+            "# TYPE %spackage_failed gauge" % prefix,
+        ]
+        for package_series_name, name, package in self.sorted_packages():
+            lines.append('%spackage_failed{series="%s",package="%s"} %d' % (prefix, label(package_series_name), label(name), package["failed"]))
+        lines += [
+            "# HELP %spackage_skipped Whether a package was left unchecked at the run deadline" % prefix,
+            "# TYPE %spackage_skipped gauge" % prefix,
+        ]
+        for package_series_name, name, package in self.sorted_packages():
+            lines.append('%spackage_skipped{series="%s",package="%s"} %d' % (prefix, label(package_series_name), label(name), package["skipped"]))
+        return "\n".join(lines) + "\n"
+
+metrics = RunMetrics()
+
+# Write a report next to its final location first, so a reader never sees it half written
+def write_report(path, content):
+    with open(path + ".new", "w") as report_file:
+        report_file.write(content)
+    os.replace(path + ".new", path)
+
+# Values computed at most once per key and shared by all the threads. A
+# thread asking for a key being computed waits for it, other keys are
+# computed in parallel. A computation that failed is not run again either,
+# its error is raised to every thread asking for the key.
+class OnceCache:
+    def __init__(self, name):
+        self.name = name
+        self.values = {}
+        self.locks = {}
+        self.lock = threading.Lock()
+
+    def get(self, key, compute):
+        with self.lock:
+            key_lock = self.locks.setdefault(key, threading.Lock())
+        with key_lock:
+            metrics.cache(self.name, key in self.values)
+            if key not in self.values:
+                try:
+                    self.values[key] = (compute(), None)
+                except Exception as error:
+                    self.values[key] = (None, error)
+            value, error = self.values[key]
+            if error is not None:
+                raise error
+            return value
+
+    def clear(self):
+        with self.lock:
+            self.values = {}
+            self.locks = {}
+
+# With --database, every publication seen by a run is recorded with when it
+# was first and last seen, along with the outcome of the run and of each of
+# its packages. The publications are collected by the worker threads and
+# written by the main thread in one transaction at the end of the run.
+class ObservationStore:
+    schema = """
+        CREATE TABLE IF NOT EXISTS observations (
+            archive TEXT NOT NULL,
+            series TEXT NOT NULL,
+            package TEXT NOT NULL,
+            pocket TEXT NOT NULL,
+            version TEXT NOT NULL,
+            date_published TEXT,
+            first_seen TEXT NOT NULL,
+            last_seen TEXT NOT NULL,
+            PRIMARY KEY (archive, series, package, pocket, version)
+        );
+        CREATE INDEX IF NOT EXISTS observations_first_seen ON observations (first_seen);
+        CREATE TABLE IF NOT EXISTS runs (
+            id INTEGER PRIMARY KEY,
+            started TEXT NOT NULL,
+            seconds REAL NOT NULL,
+            series TEXT NOT NULL,
+            pockets TEXT NOT NULL,
+            checked INTEGER NOT NULL,
+            failed INTEGER NOT NULL,
+            skipped INTEGER NOT NULL,
+            deferred INTEGER NOT NULL
+        );
+        CREATE TABLE IF NOT EXISTS run_packages (
+            run_id INTEGER NOT NULL REFERENCES runs (id),
+            series TEXT NOT NULL,
+            package TEXT NOT NULL,
+            upstream_series TEXT NOT NULL,
+            outcome TEXT NOT NULL,
+            patched_version TEXT,
+            newest_version TEXT
+        );
+    """
+
+    def __init__(self, path):
+        self.connection = sqlite3.connect(path)
+        self.connection.executescript(self.schema)
+        self.lock = threading.Lock()
+        self.pending = {}
+
+    # Publications are (archive, series, package, pocket, version, date_published)
+    def observe(self, publications):
+        with self.lock:
+            for publication in publications:
+                key = publication[:5]
+                if key not in self.pending or publication[5] is not None:
+                    self.pending[key] = publication[5]
+
+    def write_observations(self):
+        seen = run_started.isoformat()
+        with self.lock:
+            observations = [key + (date_published, seen, seen) for key, date_published in self.pending.items()]
+            self.pending = {}
+        with self.connection:
+            # Upserts need SQLite 3.24, older than some of the supported series
+            self.connection.executemany("INSERT OR IGNORE INTO observations VALUES (?, ?, ?, ?, ?, ?, ?, ?)", observations)
+            self.connection.executemany("""UPDATE observations SET last_seen = ?, date_published = COALESCE(?, date_published)
+                WHERE archive = ? AND series = ? AND package = ? AND pocket = ? AND version = ?""",
+                [(seen, observation[5]) + observation[:5] for observation in observations])
+
+    # Outcomes are (series, package, upstream series, outcome, patched version, newest version)
+    def write_run(self, report, outcomes):
+        counts = collections.Counter(outcome for _, _, _, outcome, _, _ in outcomes)
+        with self.connection:
+            run_id = self.connection.execute("INSERT INTO runs (started, seconds, series, pockets, checked, failed, skipped, deferred) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+                (report["started"], report["seconds"], json.dumps(report["series"]), json.dumps(pockets),
+                counts["checked"] + counts["unchanged"], counts["failed"], counts["skipped"], counts["deferred"])).lastrowid
+            self.connection.executemany("INSERT INTO run_packages VALUES (?, ?, ?, ?, ?, ?, ?)",
+                [(run_id,) + outcome for outcome in outcomes])
+
+    # Earliest publication date of every version of a package, in the pockets
+    # searched, by series
+    def publication_dates(self, archive, component_name):
+        dates = {}
+        for publication_series_name, version, date_published in self.connection.execute("""SELECT series, version, MIN(date_published)
+                FROM observations WHERE archive = ? AND package = ? AND date_published IS NOT NULL
+                AND pocket IN (%s) GROUP BY series, version""" % ", ".join("?" * len(all_pockets)), (archive, component_name, *all_pockets)):
+            dates.setdefault(publication_series_name, []).append((version, datetime.datetime.fromisoformat(date_published)))
+        return dates
 
-if not upstream_series_name:
-    upstream_series_name = series_name
+    def changes_since(self, since):
+        return self.connection.execute("""SELECT archive, series, package, pocket, version, date_published, first_seen
+            FROM observations WHERE first_seen >= ? ORDER BY first_seen, archive, series, package, pocket""",
+            (since.astimezone(datetime.timezone.utc).isoformat(),)).fetchall()
 
-component_name = sys.argv[1]
+observation_store = ObservationStore(args.database) if args.database is not None else None
+
+def observe_publications(archive, sources):
+    if observation_store is None:
+        return
+    observation_store.observe((archive, series_name_from_link(source["distro_series_link"]), source["source_package_name"],
+        source["pocket"], source["source_package_version"], source.get("date_published")) for source in sources)
+
+# The patch lag of a package is the time between the publication of an Ubuntu
+# version and the publication of the PPA version rebased on it, that is the
+# first PPA version at least as new. Every rebase recorded in --database is a
+# sample. A package whose newest Ubuntu version is not rebased yet is also
+# behind since the first newer Ubuntu version was published.
+patch_lag_quantiles = [0.5, 0.9, 0.99]
+
+def package_patch_lag(package_series_name, component_name, upstream_series_name):
+    ppa_publications = sorted(observation_store.publication_dates("ppa", component_name).get(package_series_name, []),
+        key=lambda publication: publication[1])
+    ubuntu_publications = observation_store.publication_dates("ubuntu", component_name).get(upstream_series_name, [])
+
+    rebase_lags = []
+    rebased_versions = set()
+    for ppa_version, ppa_published in ppa_publications:
+        base = None
+        for version, published in ubuntu_publications:
+            if published <= ppa_published and apt_pkg.version_compare(version, ppa_version) <= 0 \
+                    and (base is None or apt_pkg.version_compare(version, base[0]) > 0):
+                base = (version, published)
+        if base is not None and base[0] not in rebased_versions:
+            rebased_versions.add(base[0])
+            rebase_lags.append((ppa_published - base[1]).total_seconds())
+
+    behind_seconds = 0.0
+    newest_ppa_version = None
+    for version, _ in ppa_publications:
+        if newest_ppa_version is None or apt_pkg.version_compare(version, newest_ppa_version) > 0:
+            newest_ppa_version = version
+    if newest_ppa_version is not None:
+        newer_dates = [published for version, published in ubuntu_publications if apt_pkg.version_compare(version, newest_ppa_version) > 0]
+        if newer_dates:
+            behind_seconds = (run_started - min(newer_dates)).total_seconds()
+    return {"rebase_lags_seconds": rebase_lags, "behind_seconds": behind_seconds}
+
+def percentile(values, quantile):
+    values = sorted(values)
+    return values[max(0, math.ceil(quantile * len(values)) - 1)]
+
+# Quantiles of the rebase lags and largest current lag of every series
+def patch_lag_summary(package_lags):
+    summary = {}
+    for lag_series_name, series_packages in package_lags.items():
+        samples = [lag for package in series_packages.values() for lag in package["rebase_lags_seconds"]]
+        summary[lag_series_name] = {
+            "count": len(samples),
+            "sum": sum(samples),
+            "quantiles": {str(quantile): percentile(samples, quantile) for quantile in patch_lag_quantiles} if samples else {},
+            "behind": sum(1 for package in series_packages.values() if package["behind_seconds"] > 0),
+            "max_behind_seconds": max([package["behind_seconds"] for package in series_packages.values()] + [0.0]),
+        }
+    return summary
+
+def patch_lags():
+    package_lags = {}
+    for package_series_name, component_name, upstream_series_name in packages:
+        package_lags.setdefault(package_series_name, {})[component_name] = package_patch_lag(package_series_name, component_name, upstream_series_name)
+    return {"series": patch_lag_summary(package_lags), "packages": package_lags}
+
+# --changes-since takes a date or a number of days or hours before now
+def parse_changes_since(argument):
+    if argument[-1:] in ["d", "h"] and argument[:-1].isdigit():
+        unit = "days" if argument[-1] == "d" else "hours"
+        return run_started - datetime.timedelta(**{unit: int(argument[:-1])})
+    since = datetime.datetime.fromisoformat(argument)
+    if since.tzinfo is None:
+        since = since.replace(tzinfo=datetime.timezone.utc)
+    return since
+
+# Answering --changes-since only needs the database, so it is done before
+# anything is set up for a run
+if args.changes_since is not None:
+    try:
+        since = parse_changes_since(args.changes_since)
+    except ValueError:
+        parser.error("--changes-since expects a date, Nd or Nh, got `%s`" % (args.changes_since))
+    for archive, change_series_name, component_name, pocket, version, date_published, first_seen in observation_store.changes_since(since):
+        print("%s %s/%s %s %s (published %s, first seen %s)" % (archive, change_series_name, pocket, component_name, version,
+            date_published or "at an unknown date", first_seen))
+    sys.exit()
 
 # Initialize APT
 apt_pkg.init_system()
 
-# Initialize Launchpad variables
-launchpad = Launchpad.login_anonymously(
-    'elementary daily test',
-    'production',
-    "~/.launchpadlib/cache/",
-    version='devel'
-)
+# Initialize Launchpad variables. A Launchpad session is not thread safe, so
+# every worker thread logs in with its own session.
+class LaunchpadSession:
+    def __init__(self):
+        with metrics.call("launchpad.login"):
+            self.launchpad = Launchpad.login_anonymously(
+                'elementary daily test',
+                args.launchpad_service_root,
+                args.cache_dir,
+                timeout=args.call_timeout,
+                version='devel'
+            )
+
+        with metrics.call("launchpad.distributions"):
+            self.ubuntu = self.launchpad.distributions["ubuntu"]
+            self.ubuntu_archive_link = self.ubuntu.main_archive_link
+        with metrics.call("launchpad.getPPAByName"):
+            self.patches_archive = self.launchpad.people['elementary-os'].getPPAByName(distribution=self.ubuntu,name='os-patches')
+            self.patches_archive_link = self.patches_archive.self_link
+
+    # Call a named GET operation of the web service directly and yield the raw
+    # JSON entries, without building launchpadlib objects for them. Only the
+    # first page of page_size entries is fetched unless all_pages is set.
+    def get_entries(self, resource_link, operation, page_size, all_pages=False, **parameters):
+        parameters.update({"ws.op": operation, "ws.size": page_size})
+        url = "%s?%s" % (resource_link, urllib.parse.urlencode(parameters))
+        while url is not None:
+            collection = json.loads(self.launchpad._browser.get(url))
+            yield from collection["entries"]
+            url = collection.get("next_collection_link") if all_pages else None
+
+launchpad_sessions = threading.local()
+
+def get_launchpad_session():
+    if not hasattr(launchpad_sessions, "session"):
+        launchpad_sessions.session = LaunchpadSession()
+    return launchpad_sessions.session
 
-ubuntu = launchpad.distributions["ubuntu"]
-ubuntu_archive = ubuntu.main_archive
-patches_archive = launchpad.people['elementary-os'].getPPAByName(distribution=ubuntu,name='os-patches')
-series = ubuntu.getSeries(name_or_version=series_name)
-upstream_series = ubuntu.getSeries(name_or_version=upstream_series_name)
+# Run an idempotent Launchpad lookup, given as a function of the session to
+# use. With --hedge-after, a lookup that has not answered in time is sent a
+# second time, and the first successful answer is used. The first attempt
+# uses the session of the calling thread, which is logged in before the wait
+# starts, so only the lookups that are really slow pay for a second session.
+# It runs on a hedge thread while the calling thread waits, and the second
+# attempt runs on another one with the session of that thread. A lookup left
+# behind is not interrupted but its answer is ignored.
+hedge_executor = ThreadPoolExecutor(max_workers=2 * args.jobs) if args.hedge_after is not None else None
+
+def hedged(request):
+    session = get_launchpad_session()
+    if hedge_executor is None:
+        return request(session)
+
+    # Calls made on the hedge threads still count for the package being checked
+    package = getattr(metrics.current, "package", None)
+    def run(run_session):
+        metrics.current.package = package
+        try:
+            return request(run_session())
+        finally:
+            metrics.current.package = None
+
+    first = hedge_executor.submit(run, lambda: session)
+    done, _ = wait([first], timeout=args.hedge_after)
+    if done:
+        return first.result()
+
+    metrics.count("hedged_requests")
+    second = hedge_executor.submit(run, get_launchpad_session)
+    pending = [first, second]
+    while True:
+        done, _ = wait(pending, return_when=FIRST_COMPLETED)
+        for future in done:
+            pending.remove(future)
+            if future.exception() is None:
+                if future is second:
+                    metrics.count("hedged_requests_won")
+                    # The session of the calling thread is still busy with the
+                    # first attempt, the next lookups of the thread get a new one
+                    if first in pending:
+                        del launchpad_sessions.session
+                return future.result()
+        if not pending:
+            return first.result()
+
+# Series objects are looked up once and shared by every package and thread using them
+series_by_name = {}
+series_lock = threading.Lock()
+
+def get_series(name):
+    with series_lock:
+        metrics.cache("series", name in series_by_name)
+        if name not in series_by_name:
+            with metrics.call("launchpad.getSeries"):
+                series_by_name[name] = hedged(lambda session: session.ubuntu.getSeries(name_or_version=name))
+        return series_by_name[name]
 
 # Initialize GitHub variables
 github_token = os.environ['GITHUB_TOKEN']
 github_repo = os.environ['GITHUB_REPOSITORY']
-github = Github(github_token)
-repo = github.get_repo(github_repo)
+# PyGithub only takes a whole number of seconds
+github = Github(github_token, base_url=args.github_api_url, timeout=math.ceil(args.call_timeout))
+
+# Every GitHub request goes through the scheduler, which follows the rate
+# limit headers of the previous responses. Once fewer than --github-reserve
+# requests remain, the requests are spread over the time left until the limit
+# resets. A request refused because of a primary or secondary rate limit is
+# retried after Retry-After (or the reset time), as long as the run has not
+# waited more than --github-max-wait in total. Writes are queued and sent at
+# the end of the run, spaced out as GitHub asks for content creation.
+class GitHubScheduler:
+    max_retries = 3
+    write_interval = 1.0
+
+    def __init__(self):
+        self.waited = 0.0
+        self.retries = 0
+        self.writes = []
+        self.remaining_at_start = None
+        self.remaining = None
+        self.limit = None
+        self.reset = None
+
+    def observe(self, remaining, limit, reset):
+        if self.remaining_at_start is None:
+            self.remaining_at_start = remaining
+        self.remaining, self.limit, self.reset = remaining, limit, reset
+
+    def wait(self, seconds):
+        seconds = min(seconds, args.github_max_wait - self.waited)
+        if seconds > 0:
+            time.sleep(seconds)
+            self.waited += seconds
+
+    def pace(self):
+        if self.remaining is None or self.remaining < 0 or self.remaining > args.github_reserve:
+            return
+        self.wait((self.reset - time.time()) / max(self.remaining, 1))
+
+    def retry_after(self, error):
+        if error.status not in [403, 429]:
+            return None
+        headers = {name.lower(): value for name, value in (getattr(error, "headers", None) or {}).items()}
+        if "retry-after" in headers:
+            return float(headers["retry-after"])
+        if headers.get("x-ratelimit-remaining") == "0" and "x-ratelimit-reset" in headers:
+            return max(0.0, float(headers["x-ratelimit-reset"]) - time.time()) + 1
+        return None
+
+    # Run a request. Raw requests report the rate limit headers they got through
+    # observe, for the others the state PyGithub keeps is read.
+    def call(self, endpoint, request, raw=False):
+        attempt = 0
+        while True:
+            self.pace()
+            try:
+                with metrics.call(endpoint):
+                    result = request()
+            except GithubException as error:
+                retry_after = self.retry_after(error)
+                if retry_after is None or attempt >= self.max_retries or self.waited + retry_after > args.github_max_wait:
+                    raise
+                attempt += 1
+                self.retries += 1
+                self.wait(retry_after)
+                continue
+            if not raw:
+                self.observe(github.rate_limiting[0], github.rate_limiting[1], github.rate_limiting_resettime)
+            return result
+
+    def queue_write(self, package_series_name, component_name, write):
+        self.writes.append((package_series_name, component_name, write))
+
+    # Send the queued writes, returning the (series, package) of those that
+    # failed. A write refused by GitHub or lost on the network only fails its
+    # own package, the others are still sent.
+    def flush_writes(self):
+        failed = []
+        last_write = None
+        for package_series_name, component_name, write in self.writes:
+            if last_write is not None:
+                time.sleep(max(0.0, last_write + self.write_interval - time.monotonic()))
+            last_write = time.monotonic()
+            try:
+                write()
+            except (GithubException, requests.exceptions.RequestException) as error:
+                print("Failed to open the issue of `%s` in %s: %s" % (component_name, package_series_name, error), file=sys.stderr)
+                failed.append((package_series_name, component_name))
+        self.writes = []
+        return failed
+
+    def budget(self):
+        return {
+            "limit": self.limit,
+            "remaining_at_start": self.remaining_at_start,
+            "remaining": self.remaining,
+            "reset": self.reset,
+            "waited_seconds": self.waited,
+            "retries": self.retries,
+        }
+
+github_scheduler = GitHubScheduler()
+
+# The repository is only needed to build the URLs of the issue creations, so
+# it is not fetched at all
+repo = github.get_repo(github_repo, lazy=True)
+
+# The issue listings are requested directly, with the ETag and Last-Modified
+# of the previous runs kept in --github-cache. GitHub does not count 304
+# responses against the rate limit, and the cached pages are used for them.
+class GitHubConditionalCache:
+    def __init__(self, path):
+        self.path = path
+        self.entries = {}
+        if path is not None and os.path.exists(path):
+            with open(path) as cache_file:
+                self.entries = json.load(cache_file)
+
+    def get_json(self, url):
+        request = urllib.request.Request(url, headers={
+            "Accept": "application/vnd.github+json",
+            "Authorization": "token %s" % (github_token),
+            "User-Agent": "elementary-os-patches",
+        })
+        entry = self.entries.get(url)
+        if entry is not None and entry.get("etag") is not None:
+            request.add_header("If-None-Match", entry["etag"])
+        if entry is not None and entry.get("last_modified") is not None:
+            request.add_header("If-Modified-Since", entry["last_modified"])
+
+        try:
+            with urllib.request.urlopen(request, timeout=args.call_timeout) as response:
+                headers = response.headers
+                entry = {
+                    "etag": headers.get("ETag"),
+                    "last_modified": headers.get("Last-Modified"),
+                    "link": headers.get("Link"),
+                    "body": json.load(response),
+                }
+            metrics.cache("github_conditional", False)
+        except urllib.error.HTTPError as error:
+            headers = error.headers
+            if error.code != 304 or entry is None:
+                raise GithubException(error.code, error.read().decode("utf-8", errors="replace"), dict(headers))
+            metrics.cache("github_conditional", True)
+
+        if "X-RateLimit-Remaining" in headers:
+            github_scheduler.observe(int(headers["X-RateLimit-Remaining"]), int(headers["X-RateLimit-Limit"]),
+                int(headers["X-RateLimit-Reset"]))
+        if self.path is not None:
+            self.entries[url] = entry
+        return entry["body"], entry["link"]
+
+    # Follow the rel="next" links of a listing and return all its items
+    def get_all_pages(self, url):
+        items = []
+        while url is not None:
+            body, link = self.get_json(url)
+            items += body
+            url = None
+            for part in (link or "").split(","):
+                target, _, rel = part.partition(";")
+                if rel.strip() == 'rel="next"':
+                    url = target.strip().strip("<>")
+        return items
+
+    def write(self):
+        if self.path is None:
+            return
+        with open(self.path + ".new", "w") as cache_file:
+            json.dump(self.entries, cache_file)
+        os.replace(self.path + ".new", self.path)
+
+github_cache = GitHubConditionalCache(args.github_cache)
+
+# Open issues (not pull requests) of GitHub Actions matching the filters, by title
+github_bot_login = "github-actions[bot]"
+
+def github_list_bot_issues(endpoint, **filters):
+    filters.update({"state": "open", "creator": github_bot_login, "per_page": 100})
+    url = "%s/repos/%s/issues?%s" % (args.github_api_url.rstrip("/"), github_repo, urllib.parse.urlencode(filters))
+    issues = github_scheduler.call(endpoint, functools.partial(github_cache.get_all_pages, url), raw=True)
+    return {issue["title"]: issue for issue in issues
+        if issue["user"]["login"] == github_bot_login and "pull_request" not in issue}
+
+# Open issues opened by GitHub Actions, indexed by title. They are listed once
+# per run and issues created during the run are added as they are opened.
+open_bot_issues = None
+
+def load_open_bot_issues():
+    global open_bot_issues
+    if open_bot_issues is None:
+        open_bot_issues = github_list_bot_issues("github.get_issues")
+    return open_bot_issues
+
+# Every issue is labelled with its package, and its body ends with a hidden
+# marker recording what it was opened for. With --issue-lookup=labels the open
+# issues of a package are found with one filtered query, however many other
+# issues are open. Label names are limited to 50 characters by GitHub, longer
+# package names fall back to the index.
+github_label_max_length = 50
+github_security_label = "security"
+labelled_bot_issues = {}
+
+def github_package_label(component_name):
+    label = "package/%s" % (component_name)
+    if len(label) > github_label_max_length:
+        return None
+    return label
+
+def load_labelled_bot_issues(component_name):
+    if component_name not in labelled_bot_issues:
+        labelled_bot_issues[component_name] = github_list_bot_issues("github.get_issues.labels",
+            labels=github_package_label(component_name))
+    return labelled_bot_issues[component_name]
+
+def load_package_bot_issues(component_name):
+    if args.issue_lookup == "labels" and github_package_label(component_name) is not None:
+        return load_labelled_bot_issues(component_name)
+    return load_open_bot_issues()
+
+def github_issue_marker(kind, component_name, package_series_name, version):
+    return "<!-- get-latest-version: %s -->" % json.dumps({"kind": kind, "package": component_name,
+        "series": package_series_name, "version": version}, sort_keys=True)
 
 # Method for checking if GitHub Actions has already opened an issue with this title
-def github_issue_exists(title):
-    open_issues = repo.get_issues(state='open')
-    for issue in open_issues:
-        if issue.title == title and issue.user.login == "github-actions[bot]":
-            return True
-    return False
-
-# Get the current version of a package in elementary os patches PPA
-patched_sources = patches_archive.getPublishedSources(exact_match=True,
-    source_name=component_name,
-    status="Published",
-    distro_series=series)
-if len(patched_sources) == 0:
-    issue_title = "Package `%s` not found in os-patches PPA" % (component_name)
-    if not github_issue_exists(issue_title):
-        issue = repo.create_issue(issue_title, "`%s` found in the import list, but not in the PPA. Not deployed yet or removed by accident?" % (component_name))
-        print("Package `%s` not found in elementary os-patches! - Created issue %d" % (component_name, issue.number))
-    sys.exit(0)
-
-patched_version = patched_sources[0].source_package_version
-
-# Search for a new version in the Ubuntu repositories
-pockets = ["Release", "Security", "Updates"]
-for pocket in pockets:
-    found_sources = ubuntu_archive.getPublishedSources(exact_match=True,
-        source_name=component_name,
-        status="Published",
-        pocket=pocket,
-        distro_series=upstream_series)
-    if len(found_sources) > 0:
-        pocket_version = found_sources[0].source_package_version
-        if apt_pkg.version_compare(pocket_version, patched_version) > 0:
-            issue_title = "New version of %s available" % (component_name)
-            if not github_issue_exists(issue_title):
-                issue = repo.create_issue(issue_title, "The package `%s` in `%s` can be upgraded to version `%s`" % (component_name, upstream_series_name, pocket_version))
-                print("The patched package `%s` has a new version `%s` (was version `%s`) - Created issue %d" % (component_name, pocket_version, patched_version, issue.number))
+def github_issue_exists(component_name, title):
+    exists = title in load_package_bot_issues(component_name)
+    metrics.cache("open_issues", exists)
+    return exists
+
+# Issues left to the merge step with --partial-report
+partial_report_issues = []
+
+# Queue the creation of an issue. The title is indexed right away so the issue
+# is not queued twice.
+def github_create_issue(package_series_name, component_name, title, body, marker, message, extra_labels=[]):
+    package_issues = load_package_bot_issues(component_name)
+    package_issues[title] = None
+
+    if args.partial_report is not None:
+        print("%s - Issue left to the merge step" % (message))
+        partial_report_issues.append({"series": package_series_name, "package": component_name,
+            "title": title, "body": body, "marker": marker, "message": message, "labels": extra_labels})
+        return
+
+    labels = [label for label in [github_package_label(component_name)] if label is not None] + extra_labels
+
+    def create_issue():
+        issue = github_scheduler.call("github.create_issue", lambda: repo.create_issue(title, "%s\n\n%s" % (body, marker), labels=labels))
+        package_issues[title] = issue
+        print("Created issue %d: %s" % (issue.number, title))
+
+    print("%s - Opening an issue" % (message))
+    github_scheduler.queue_write(package_series_name, component_name, create_issue)
+
+# Pockets of the Ubuntu repositories searched for new versions
+all_pockets = ["Release", "Security", "Updates"]
+pockets = ["Security"] if args.security_only else all_pockets
+
+# Filters of the archive queries restricting them to the searched pockets
+def pocket_filters():
+    if len(pockets) == 1:
+        return {"pocket": pockets[0]}
+    return {}
+
+# With --ppa-snapshot, all the published sources of the PPA are fetched at
+# once, in pages of the largest size Launchpad allows, for the series of the
+# run (or all of them when there are several) and indexed by (series, package).
+ppa_snapshot_page_size = 300
+ppa_snapshot = None
+ppa_snapshot_lock = threading.Lock()
+
+def series_name_from_link(series_link):
+    return series_link.rstrip("/").rsplit("/", 1)[-1]
+
+def load_ppa_snapshot():
+    session = get_launchpad_session()
+    filters = {}
+    if len(series_names) == 1:
+        filters["distro_series"] = get_series(series_names[0]).self_link
+    snapshot = {}
+    with metrics.call("launchpad.ppa.getPublishedSources.all"):
+        sources = list(session.get_entries(session.patches_archive_link, "getPublishedSources", ppa_snapshot_page_size,
+            all_pages=True,
+            status="Published",
+            **filters))
+    observe_publications("ppa", sources)
+    for source in sources:
+        key = (series_name_from_link(source["distro_series_link"]), source["source_package_name"])
+        if key not in snapshot or apt_pkg.version_compare(source["source_package_version"], snapshot[key]) > 0:
+            snapshot[key] = source["source_package_version"]
+    return snapshot
+
+def query_snapshot_patched_version(package_series_name, component_name):
+    global ppa_snapshot
+    with ppa_snapshot_lock:
+        metrics.cache("ppa_snapshot", ppa_snapshot is not None)
+        if ppa_snapshot is None:
+            ppa_snapshot = load_ppa_snapshot()
+    return ppa_snapshot.get((package_series_name, component_name))
+
+# Get the current version of a package in elementary os patches PPA. Only the
+# newest publication is needed, so a single entry is requested.
+def query_patched_version(package_series_name, component_name):
+    if args.ppa_snapshot:
+        return query_snapshot_patched_version(package_series_name, component_name)
+
+    package_series = get_series(package_series_name)
+    def request(session):
+        sources = list(session.get_entries(session.patches_archive_link, "getPublishedSources", 1,
+            exact_match="true",
+            source_name=component_name,
+            status="Published",
+            distro_series=package_series.self_link,
+            order_by_date="true"))
+        observe_publications("ppa", sources)
+        return sources
+    with metrics.call("launchpad.ppa.getPublishedSources"):
+        for source in hedged(request):
+            return source["source_package_version"]
+    return None
+
+# Get the current version of a package in each pocket of the Ubuntu repositories.
+# All the pockets are fetched with a single query and split on our side. A
+# package found in several import list entries is fetched for all the series
+# at once, see query_fused_pocket_versions. The lookups go through the query
+# cache shared with other runs.
+def query_pocket_versions(component_name, upstream_series_name):
+    if args.query_cache is None:
+        return fetch_pocket_versions(component_name, upstream_series_name)
+
+    pocket_versions = query_cache.lookup(component_name, upstream_series_name)
+    if pocket_versions is None:
+        pocket_versions = fetch_pocket_versions(component_name, upstream_series_name)
+        query_cache.store(component_name, upstream_series_name, pocket_versions)
+    return pocket_versions
+
+def fetch_pocket_versions(component_name, upstream_series_name):
+    if import_list_entries_by_package[component_name] > 1:
+        return query_fused_pocket_versions(component_name, upstream_series_name)
+
+    upstream_series = get_series(upstream_series_name)
+    def request(session):
+        sources = list(session.get_entries(session.ubuntu_archive_link, "getPublishedSources", 20,
+            all_pages=True,
+            exact_match="true",
+            source_name=component_name,
+            status="Published",
+            distro_series=upstream_series.self_link,
+            **pocket_filters()))
+        observe_publications("ubuntu", sources)
+        return [(source["pocket"], source["source_package_version"]) for source in sources]
+    with metrics.call("launchpad.archive.getPublishedSources"):
+        found_sources = hedged(request)
+    return newest_pocket_versions(found_sources)
+
+def newest_pocket_versions(found_sources):
+    pocket_versions = {}
+    for pocket, pocket_version in found_sources:
+        if pocket not in pockets:
+            continue
+        if pocket not in pocket_versions or apt_pkg.version_compare(pocket_version, pocket_versions[pocket]) > 0:
+            pocket_versions[pocket] = pocket_version
+    return [(pocket, pocket_versions[pocket]) for pocket in pockets if pocket in pocket_versions]
+
+# Versions found in the pockets of the Ubuntu archive, shared between runs
+# through the --query-cache file and keyed by (package, upstream series,
+# pocket). A pocket without the package is recorded too. Entries are reused
+# until they are older than --query-cache-ttl, so runs for different series
+# close in time do not ask Launchpad the same thing twice.
+class QueryCache:
+    def __init__(self, path, ttl):
+        self.path = path
+        self.ttl = ttl
+        self.lock = threading.Lock()
+        self.entries = self.read()
+
+    def read(self):
+        if not os.path.exists(self.path):
+            return {}
+        with open(self.path) as cache_file:
+            return json.load(cache_file)
+
+    def key(self, component_name, upstream_series_name, pocket):
+        return "%s:%s:%s" % (component_name, upstream_series_name, pocket)
+
+    def lookup(self, component_name, upstream_series_name):
+        now = time.time()
+        pocket_versions = []
+        with self.lock:
+            for pocket in pockets:
+                entry = self.entries.get(self.key(component_name, upstream_series_name, pocket))
+                if entry is None or now - entry["fetched"] > self.ttl:
+                    metrics.cache("query_cache", False)
+                    return None
+                if entry["version"] is not None:
+                    pocket_versions.append((pocket, entry["version"]))
+        metrics.cache("query_cache", True)
+        return pocket_versions
+
+    def store(self, component_name, upstream_series_name, pocket_versions):
+        now = time.time()
+        versions = dict(pocket_versions)
+        with self.lock:
+            for pocket in pockets:
+                self.entries[self.key(component_name, upstream_series_name, pocket)] = {"version": versions.get(pocket), "fetched": now}
+
+    # Merge with the file as it is now, in case another run updated it meanwhile,
+    # and drop the expired entries
+    def write(self):
+        now = time.time()
+        with self.lock:
+            entries = self.read()
+            entries.update(self.entries)
+            entries = {key: entry for key, entry in entries.items() if now - entry["fetched"] <= self.ttl}
+            with open(self.path + ".new", "w") as cache_file:
+                json.dump(entries, cache_file, indent=2, sort_keys=True)
+            os.replace(self.path + ".new", self.path)
+
+query_cache = QueryCache(args.query_cache, args.query_cache_ttl) if args.query_cache is not None else None
+
+# Number of import list entries of each package, across all the series
+import_list_entries_by_package = collections.Counter(component_name for _, component_name, _ in packages)
+
+# Publications of a package in every series, from a single archive query
+# without a series filter, as (series, pocket, version) tuples. Every entry of
+# the package, whatever its series and upstream series, is served from it.
+fused_publications = OnceCache("fused_publications")
+
+def query_fused_publications(component_name):
+    def request(session):
+        sources = list(session.get_entries(session.ubuntu_archive_link, "getPublishedSources", 75,
+            all_pages=True,
+            exact_match="true",
+            source_name=component_name,
+            status="Published",
+            **pocket_filters()))
+        observe_publications("ubuntu", sources)
+        return [(series_name_from_link(source["distro_series_link"]), source["pocket"], source["source_package_version"]) for source in sources]
+    with metrics.call("launchpad.archive.getPublishedSources.fused"):
+        return hedged(request)
+
+def query_fused_pocket_versions(component_name, upstream_series_name):
+    publications = fused_publications.get(component_name, functools.partial(query_fused_publications, component_name))
+    return newest_pocket_versions([(pocket, version) for publication_series_name, pocket, version in publications
+        if publication_series_name == upstream_series_name])
+
+# An incremental check does not query its package: the publications created
+# in each upstream series since the oldest last check of the packages checked
+# are swept once, with a paged query without any package filter, and every
+# package is answered from the sweep. A quiet day then costs a page or two
+# per upstream series, and the PPA is only asked about the packages found in
+# the sweep.
+series_sweeps = OnceCache("series_sweep")
+series_sweep_since = {}
+series_sweep_page_size = 300
+
+def sweep_series_publications(upstream_series_name):
+    wanted_packages = set(component_name for _, component_name, package_upstream_series_name in packages
+        if package_upstream_series_name == upstream_series_name)
+    upstream_series = get_series(upstream_series_name)
+    def request(session):
+        return list(session.get_entries(session.ubuntu_archive_link, "getPublishedSources", series_sweep_page_size,
+            all_pages=True,
+            status="Published",
+            distro_series=upstream_series.self_link,
+            created_since_date=series_sweep_since[upstream_series_name].isoformat(),
+            **pocket_filters()))
+    with metrics.call("launchpad.archive.getPublishedSources.since"):
+        sources = [source for source in hedged(request) if source["source_package_name"] in wanted_packages]
+    observe_publications("ubuntu", sources)
+    publications = {}
+    for source in sources:
+        publications.setdefault(source["source_package_name"], []).append(
+            (datetime.datetime.fromisoformat(source["date_created"]), source["pocket"], source["source_package_version"]))
+    return publications
+
+def query_swept_pocket_versions(component_name, upstream_series_name, created_since):
+    publications = series_sweeps.get(upstream_series_name, functools.partial(sweep_series_publications, upstream_series_name))
+    return newest_pocket_versions([(pocket, version) for date_created, pocket, version in publications.get(component_name, [])
+        if date_created >= created_since])
+
+# Start of the sweep of each upstream series: the oldest last check, less the
+# overlap, of the packages of the run checked incrementally
+def set_series_sweep_since(scheduled_packages):
+    series_sweep_since.clear()
+    for package_series_name, component_name, upstream_series_name in scheduled_packages:
+        created_since = incremental_check_since(package_series_name, import_list_entry(component_name, upstream_series_name))
+        if created_since is None:
+            continue
+        if upstream_series_name not in series_sweep_since or created_since < series_sweep_since[upstream_series_name]:
+            series_sweep_since[upstream_series_name] = created_since
+
+# The sources-index engine reads the Sources index of every component of the
+# pockets of an upstream series once, keeping only the packages it was asked
+# for, and then answers every package of that series locally. The indices are
+# streamed and parsed stanza by stanza, so memory stays bounded whatever their
+# size (the summaries of --index-cache hold one entry per package instead).
+index_components = ["main", "restricted", "universe", "multiverse"]
+index_pocket_suffixes = {"Release": "", "Security": "-security", "Updates": "-updates"}
+sources_index_versions = OnceCache("sources_index")
+
+# Yield the (package, version) pairs of the stanzas of a Sources index, for
+# the wanted packages or for all of them
+def parse_sources_index(lines, wanted_packages=None):
+    package = version = None
+    for line in lines:
+        if line.startswith("Package:"):
+            package = line[len("Package:"):].strip()
+        elif line.startswith("Version:"):
+            version = line[len("Version:"):].strip()
+        elif not line.strip():
+            if package is not None and version is not None and (wanted_packages is None or package in wanted_packages):
+                yield package, version
+            package = version = None
+    if package is not None and version is not None and (wanted_packages is None or package in wanted_packages):
+        yield package, version
+
+# Read the wanted packages of a Sources index of the mirror, inside the timer
+# of the request as the index is streamed while it is parsed
+def fetch_sources_index(suite, component, wanted_packages):
+    with metrics.call("archive.Sources"):
+        response = open_mirror_file("dists/%s/%s/source/Sources.xz" % (suite, component))
+        if response is None:
+            return None
+        with response, io.TextIOWrapper(lzma.open(response), encoding="utf-8", errors="replace") as sources_index:
+            return list(parse_sources_index(sources_index, wanted_packages))
+
+# Open a file of the mirror, returning None when it does not exist. A
+# Last-Modified date turns the request into a conditional one, and None is
+# also returned when the file was not modified since.
+def open_mirror_file(path, last_modified=None):
+    request = urllib.request.Request("%s/%s" % (args.mirror.rstrip("/"), path))
+    if last_modified is not None:
+        request.add_header("If-Modified-Since", email.utils.formatdate(last_modified, usegmt=True))
+    try:
+        return urllib.request.urlopen(request, timeout=args.call_timeout)
+    except urllib.error.HTTPError as error:
+        if error.code in [304, 404]:
+            return None
+        raise
+    except urllib.error.URLError as error:
+        # A partial local mirror may not carry every component
+        if isinstance(error.reason, FileNotFoundError):
+            return None
+        raise
+
+# With --index-cache, the uncompressed Sources indices are kept between runs
+# like apt keeps its lists. The InRelease file of a suite is fetched first
+# (conditionally) and a cached index is reused as long as its SHA256 matches
+# the one InRelease lists for it. A stale index is brought up to date with the
+# pdiffs of Sources.diff/Index when they cover it, and downloaded in full
+# otherwise. The signature of InRelease is not verified, the hashes are only
+# used to detect changes. Beside each index, a summary keeps its SHA256 and
+# the versions of every package it lists, computed in one pass when the index
+# is written, so an index that did not change is neither hashed nor parsed
+# again.
+def read_hash_fields(lines, fields):
+    hashes = {field: [] for field in fields}
+    current = None
+    for line in lines:
+        if line.startswith(" ") and current is not None:
+            hashes[current].append(line.split())
+            continue
+        field, _, value = line.partition(":")
+        current = field if field in hashes else None
+        if current is not None and value.strip():
+            hashes[current].append(value.split())
+    return hashes
+
+def summarize_sources_index(index_path):
+    sha256 = hashlib.sha256()
+    def lines():
+        with open(index_path, "rb") as index_file:
+            for line in index_file:
+                sha256.update(line)
+                yield line.decode("utf-8", errors="replace")
+    versions = {}
+    for package, version in parse_sources_index(lines()):
+        versions.setdefault(package, []).append(version)
+    return {"sha256": sha256.hexdigest(), "versions": versions}
+
+def read_index_summary(index_path):
+    if not os.path.exists(index_path):
+        return None
+    try:
+        with open(index_path + ".summary") as summary_file:
+            return json.load(summary_file)
+    except (OSError, ValueError):
+        # A cache written by an older version of the script, or a damaged summary
+        summary = summarize_sources_index(index_path)
+        write_index_summary(index_path, summary)
+        return summary
+
+def write_index_summary(index_path, summary):
+    with open(index_path + ".summary.new", "w") as summary_file:
+        json.dump(summary, summary_file)
+    os.replace(index_path + ".summary.new", index_path + ".summary")
+
+def update_release_file(suite):
+    release_path = os.path.join(args.index_cache, suite, "InRelease")
+    last_modified = os.path.getmtime(release_path) if os.path.exists(release_path) else None
+    with metrics.call("archive.InRelease"):
+        response = open_mirror_file("dists/%s/InRelease" % (suite), last_modified)
+        if response is not None:
+            os.makedirs(os.path.dirname(release_path), exist_ok=True)
+            with response, open(release_path + ".new", "wb") as release_file:
+                shutil.copyfileobj(response, release_file)
+            os.replace(release_path + ".new", release_path)
+            modified = response.headers.get("Last-Modified")
+            if modified is not None:
+                modified_time = email.utils.parsedate_to_datetime(modified).timestamp()
+                os.utime(release_path, (modified_time, modified_time))
+    metrics.cache("InRelease", response is None)
+    if not os.path.exists(release_path):
+        return None
+
+    with open(release_path, encoding="utf-8", errors="replace") as release_file:
+        hashes = read_hash_fields(release_file, ["SHA256"])["SHA256"]
+    return {entry[2]: entry[0] for entry in hashes if len(entry) == 3}
+
+# Apply an ed script, as produced by diff --ed, to a file. The commands of such
+# a script address the original lines from the end of the file to its start,
+# so once reversed they can be applied in a single pass over the file.
+def apply_ed_script(script_lines, source_path, target_path):
+    commands = []
+    script_lines = iter(script_lines)
+    for line in script_lines:
+        line = line.rstrip("\n")
+        if not line:
+            continue
+        address, operation = line[:-1], line[-1]
+        first, _, last = address.partition(",")
+        first = int(first)
+        last = int(last) if last else first
+        text = []
+        if operation in "ac":
+            for text_line in script_lines:
+                if text_line.rstrip("\n") == ".":
+                    break
+                text.append(text_line)
+        elif operation != "d":
+            raise ValueError("Unsupported ed command `%s`" % (line))
+        commands.append((first, last, operation, text))
+
+    with open(source_path, encoding="utf-8", errors="surrogateescape") as source, \
+            open(target_path, "w", encoding="utf-8", errors="surrogateescape") as target:
+        line_number = 0
+        for first, last, operation, text in reversed(commands):
+            # Copy the lines before the command, including the one appended after
+            copy_until = first if operation == "a" else first - 1
+            while line_number < copy_until:
+                target.write(next(source))
+                line_number += 1
+            if operation != "a":
+                while line_number < last:
+                    next(source)
+                    line_number += 1
+            target.writelines(text)
+        shutil.copyfileobj(source, target)
+
+# Returns the summary of the patched index, or None when the pdiffs do not
+# lead to the expected one
+def apply_sources_pdiffs(suite, component, index_path, current_hash, expected_hash):
+    diff_directory = "dists/%s/%s/source/Sources.diff" % (suite, component)
+    with metrics.call("archive.Sources.diff"):
+        response = open_mirror_file(diff_directory + "/Index")
+        if response is None:
+            return None
+        with response:
+            diff_index = read_hash_fields(io.TextIOWrapper(response, encoding="utf-8", errors="replace"),
+                ["SHA256-Current", "SHA256-History", "SHA256-Patches", "SHA256-Download", "X-Patch-Precedence"])
+
+    history = [entry[0] for entry in diff_index["SHA256-History"]]
+    patch_names = [entry[2] for entry in diff_index["SHA256-History"]]
+    patch_hashes = {entry[2]: entry[0] for entry in diff_index["SHA256-Patches"]}
+    if not diff_index["SHA256-Current"] or diff_index["SHA256-Current"][0][0] != expected_hash:
+        return None
+    if current_hash not in history:
+        return None
+
+    # Merged pdiffs go straight to the current index, others have to be chained
+    first_patch = history.index(current_hash)
+    merged = [["merged"]] == diff_index["X-Patch-Precedence"]
+    needed_patches = patch_names[first_patch:first_patch + 1] if merged else patch_names[first_patch:]
+    for patch_name in needed_patches:
+        with metrics.call("archive.Sources.diff"):
+            response = open_mirror_file("%s/%s.gz" % (diff_directory, patch_name))
+            if response is None:
+                return None
+            with response:
+                patch = gzip.decompress(response.read())
+        if patch_name in patch_hashes and hashlib.sha256(patch).hexdigest() != patch_hashes[patch_name]:
+            return None
+        apply_ed_script(io.StringIO(patch.decode("utf-8", errors="surrogateescape")), index_path, index_path + ".new")
+        os.replace(index_path + ".new", index_path)
+    summary = summarize_sources_index(index_path)
+    return summary if summary["sha256"] == expected_hash else None
+
+def download_sources_index(suite, component, index_path):
+    with metrics.call("archive.Sources"):
+        response = open_mirror_file("dists/%s/%s/source/Sources.xz" % (suite, component))
+        if response is None:
+            return False
+        with response, lzma.open(response) as sources_index, open(index_path + ".new", "wb") as index_file:
+            shutil.copyfileobj(sources_index, index_file)
+    os.replace(index_path + ".new", index_path)
+    return True
+
+# Errors of a pdiff that could not be fetched, decompressed or applied. The
+# index is then downloaded in full.
+pdiff_errors = (ValueError, StopIteration, EOFError, gzip.BadGzipFile, urllib.error.URLError, TimeoutError,
+    ConnectionError, http.client.HTTPException)
+
+# Return the (package, version) pairs of the wanted packages of a cached index
+def read_cached_sources_index(suite, component, release_hashes, wanted_packages):
+    index_path = os.path.join(args.index_cache, suite, component, "Sources")
+    expected_hash = release_hashes.get("%s/source/Sources" % (component))
+    if expected_hash is None:
+        return None
+
+    summary = read_index_summary(index_path)
+    up_to_date = summary is not None and summary["sha256"] == expected_hash
+    metrics.cache("sources_index_file", up_to_date)
+    if not up_to_date:
+        os.makedirs(os.path.dirname(index_path), exist_ok=True)
+        try:
+            if summary is not None:
+                summary = apply_sources_pdiffs(suite, component, index_path, summary["sha256"], expected_hash)
+        except pdiff_errors as error:
+            print("Failed to update the %s/%s Sources index with its pdiffs, downloading it: %r" % (suite, component, error),
+                file=sys.stderr)
+            metrics.count("pdiff_failures")
+            summary = None
+        if summary is None:
+            if not download_sources_index(suite, component, index_path):
+                return None
+            summary = summarize_sources_index(index_path)
+        write_index_summary(index_path, summary)
+    return [(package, version) for package in wanted_packages for version in summary["versions"].get(package, [])]
+
+def load_sources_index(upstream_series_name):
+    wanted_packages = set(component_name for _, component_name, package_upstream_series_name in packages
+        if package_upstream_series_name == upstream_series_name)
+    versions = {}
+    for pocket in pockets:
+        suite = upstream_series_name + index_pocket_suffixes[pocket]
+        release_hashes = update_release_file(suite) if args.index_cache is not None else None
+        for component in index_components:
+            if release_hashes is not None:
+                index_versions = read_cached_sources_index(suite, component, release_hashes, wanted_packages)
+            else:
+                index_versions = fetch_sources_index(suite, component, wanted_packages)
+            if index_versions is None:
+                continue
+            for package, version in index_versions:
+                if observation_store is not None:
+                    # The Sources indices do not carry publication dates
+                    observation_store.observe([("ubuntu", upstream_series_name, package, pocket, version, None)])
+                pocket_versions = versions.setdefault(package, {})
+                if pocket not in pocket_versions or apt_pkg.version_compare(version, pocket_versions[pocket]) > 0:
+                    pocket_versions[pocket] = version
+    return versions
+
+def query_index_pocket_versions(component_name, upstream_series_name):
+    pocket_versions = sources_index_versions.get(upstream_series_name,
+        functools.partial(load_sources_index, upstream_series_name)).get(component_name, {})
+    return [(pocket, pocket_versions[pocket]) for pocket in pockets if pocket in pocket_versions]
+
+# Query the PPA and the Ubuntu pockets for a package. Returns None when an
+# incremental check found no new publication, so there is nothing to report.
+def check_package(package_series_name, component_name, upstream_series_name):
+    with metrics.package(package_series_name, component_name):
+        return check_package_versions(package_series_name, component_name, upstream_series_name)
+
+def check_package_versions(package_series_name, component_name, upstream_series_name):
+    if args.engine == "sources-index":
+        patched_version = query_patched_version(package_series_name, component_name)
+        if patched_version is None:
+            return None, []
+        return patched_version, query_index_pocket_versions(component_name, upstream_series_name)
+
+    created_since = incremental_check_since(package_series_name, import_list_entry(component_name, upstream_series_name))
+    if created_since is not None:
+        pocket_versions = query_swept_pocket_versions(component_name, upstream_series_name, created_since)
+        if not pocket_versions:
+            return None
+        return query_patched_version(package_series_name, component_name), pocket_versions
+
+    patched_version = query_patched_version(package_series_name, component_name)
+    if patched_version is None:
+        return None, []
+    return patched_version, query_pocket_versions(component_name, upstream_series_name)
+
+# With --run-deadline, the packages not checked in time are skipped and the
+# run reports the ones it got through
+class RunDeadlineReached(Exception):
+    pass
+
+def run_time_left():
+    if args.run_deadline is None:
+        return None
+    return max(0.0, args.run_deadline - (time.monotonic() - run_started_clock))
+
+def run_deadline_reached():
+    return run_time_left() == 0.0
+
+# A check is only skipped when it did not finish in time: the results of the
+# checks that finished before the deadline are still used
+def start_check(package_series_name, component_name, upstream_series_name):
+    if run_deadline_reached():
+        raise RunDeadlineReached()
+    return check_package(package_series_name, component_name, upstream_series_name)
+
+def wait_for_check(future):
+    try:
+        return future.result(timeout=run_time_left())
+    except CancelledError:
+        raise RunDeadlineReached()
+    except FutureTimeoutError:
+        if future.done():
+            raise
+        raise RunDeadlineReached()
+
+# With --package-budget, the packages not checked for --revisit-interval and
+# the ones never checked are always due. The rest of the budget goes to the
+# packages with the most changes expected since their last check, from the
+# number of times their newest Ubuntu version changed since they were first
+# checked. The other packages are left for the next runs.
+def schedule_packages(packages):
+    revisit_interval = datetime.timedelta(days=args.revisit_interval)
+    due = set()
+    candidates = []
+    for package in packages:
+        package_series_name, component_name, upstream_series_name = package
+        entry = import_list_entry(component_name, upstream_series_name)
+        last_check = last_package_check(package_series_name, entry)
+        if last_check is None or run_started - last_check >= revisit_interval:
+            due.add(package)
+            continue
+        history = incremental_history.get(package_series_name, {}).get(entry)
+        changes, known_days = 0, 1.0
+        if history is not None:
+            changes = len(history["changes"])
+            known_days = max(1.0, (run_started - datetime.datetime.fromisoformat(history["first_checked"])).total_seconds() / 86400)
+        expected_changes = (changes + 1) / known_days * (run_started - last_check).total_seconds() / 86400
+        candidates.append((expected_changes, package))
+
+    candidates.sort(key=lambda candidate: candidate[0], reverse=True)
+    budget = max(0, args.package_budget - len(due))
+    scheduled = due | set(package for _, package in candidates[:budget])
+    return [package for package in packages if package in scheduled], [package for _, package in candidates[budget:]]
+
+# Check every package, yielding a callable returning the result of each one.
+# With several jobs the packages are checked in parallel, but the results are
+# still yielded in the order of the import lists. Once the run deadline is
+# reached, the checks that did not start yet are cancelled and the ones still
+# running are skipped. The worker threads, and so their Launchpad sessions,
+# are kept from one daemon run to the next.
+check_executor = ThreadPoolExecutor(max_workers=args.jobs) if args.jobs > 1 else None
+
+def check_packages(packages):
+    if check_executor is None:
+        for package in packages:
+            yield package + (functools.partial(start_check, *package),)
+        return
+
+    futures = [package + (check_executor.submit(check_package, *package),) for package in packages]
+    for package_series_name, component_name, upstream_series_name, future in futures:
+        if run_deadline_reached():
+            for _, _, _, pending_future in futures:
+                pending_future.cancel()
+        yield package_series_name, component_name, upstream_series_name, functools.partial(wait_for_check, future)
+
+# Open the issues for a checked package. This always runs on the main thread,
+# one package at a time, so the issue index never sees concurrent updates.
+def report_package(package_series_name, component_name, upstream_series_name, patched_version, pocket_versions):
+    if patched_version is None:
+        issue_title = "Package `%s` not found in os-patches PPA" % (component_name)
+        message = "Package `%s` not found in elementary os-patches for `%s`!" % (component_name, package_series_name)
+        if not github_issue_exists(component_name, issue_title):
+            github_create_issue(package_series_name, component_name, issue_title,
+                "`%s` found in the `%s` import list, but not in the PPA. Not deployed yet or removed by accident?" % (component_name, package_series_name),
+                github_issue_marker("not-found", component_name, package_series_name, None), message)
+        else:
+            print("%s - Issue already open" % (message))
+        return
+
+    # Search for a new version in the Ubuntu repositories
+    newest_pocket, newest_version = None, patched_version
+    newest_security_version = patched_version
+    for pocket, pocket_version in pocket_versions:
+        if apt_pkg.version_compare(pocket_version, newest_version) > 0:
+            newest_pocket, newest_version = pocket, pocket_version
+        if pocket == "Security" and apt_pkg.version_compare(pocket_version, newest_security_version) > 0:
+            newest_security_version = pocket_version
+
+    # Security updates get their own issue, labelled so they are triaged first.
+    # Any Security version newer than the patched one makes it a security
+    # update, even when Updates has a newer version still, so the daily and
+    # the security-only runs always open the same issue.
+    if newest_security_version != patched_version:
+        issue_title = "Security update of %s available" % (component_name)
+        message = "The patched package `%s` has a security update `%s` (was version `%s`)" % (component_name, newest_security_version, patched_version)
+        body = "The package `%s` in `%s` has a security update to version `%s` in the `Security` pocket" % (component_name, upstream_series_name, newest_security_version)
+        if newest_pocket != "Security":
+            body += ", and a newer version `%s` in the `%s` pocket" % (newest_version, newest_pocket)
+        if not github_issue_exists(component_name, issue_title):
+            github_create_issue(package_series_name, component_name, issue_title, body,
+                github_issue_marker("security-update", component_name, package_series_name, newest_security_version), message,
+                [github_security_label])
+        else:
+            print("%s - Issue already open" % (message))
+    elif newest_pocket is not None:
+        issue_title = "New version of %s available" % (component_name)
+        message = "The patched package `%s` has a new version `%s` in `%s` (was version `%s`)" % (component_name, newest_version, newest_pocket, patched_version)
+        if not github_issue_exists(component_name, issue_title):
+            github_create_issue(package_series_name, component_name, issue_title,
+                "The package `%s` in `%s` can be upgraded to version `%s` from the `%s` pocket" % (component_name, upstream_series_name, newest_version, newest_pocket),
+                github_issue_marker("new-version", component_name, package_series_name, newest_version), message)
+        else:
+            print("%s - Issue already open" % (message))
+
+# Open the issues of the partial reports written by the shards of a run. A
+# title found by several shards, or already open, is only opened once. The
+# packages that failed or were skipped in a shard are reported again here.
+def merge_partial_reports(paths):
+    for path in paths:
+        with open(path) as report_file:
+            partial_report = json.load(report_file)
+        metrics.merge(partial_report["shard"], partial_report["metrics"])
+        for report_series_name in partial_report["series"]:
+            if report_series_name not in series_names:
+                series_names.append(report_series_name)
+        failed_packages.extend(tuple(package) for package in partial_report["failed"])
+        skipped_packages.extend(tuple(package) for package in partial_report["skipped"])
+        for issue in partial_report["issues"]:
+            if github_issue_exists(issue["package"], issue["title"]):
+                print("%s - Issue already open" % (issue["message"]))
+                continue
+            github_create_issue(issue["series"], issue["package"], issue["title"], issue["body"], issue["marker"], issue["message"], issue["labels"])
+
+# Keep the launchpadlib cache under --cache-max-size by removing the entries
+# that were not read or written for the longest time
+def prune_launchpad_cache():
+    cache_dir = os.path.expanduser(args.cache_dir)
+    entries = []
+    for directory, _, file_names in os.walk(cache_dir):
+        for file_name in file_names:
+            path = os.path.join(directory, file_name)
+            stat = os.stat(path)
+            entries.append((max(stat.st_atime, stat.st_mtime), stat.st_size, path))
+
+    cache_size = sum(size for _, size, _ in entries)
+    max_size = args.cache_max_size * 1024 * 1024
+    for _, size, path in sorted(entries):
+        if cache_size <= max_size:
+            break
+        os.remove(path)
+        cache_size -= size
+
+def skip_package(package_series_name, component_name):
+    print("Skipped `%s` in %s: run deadline reached" % (component_name, package_series_name), file=sys.stderr)
+    skipped_packages.append((package_series_name, component_name))
+    metrics.package_skipped(package_series_name, component_name)
+    metrics.count("packages_skipped")
+
+# The latest result of every package and run, served by --status-port. An
+# incremental check that found no new publication keeps the versions found
+# by the previous runs.
+package_status = {}
+run_status = {"last_run": None, "next_run": None}
+status_lock = threading.Lock()
+
+def record_package_status(package_series_name, component_name, upstream_series_name, result=None, error=None):
+    with status_lock:
+        status = package_status.setdefault((package_series_name, component_name), {
+            "series": package_series_name,
+            "package": component_name,
+            "upstream_series": upstream_series_name,
+            "patched_version": None,
+            "newest_version": None,
+            "newest_pocket": None,
+        })
+        status["checked"] = datetime.datetime.now(datetime.timezone.utc).isoformat()
+        status["error"] = error
+        if result is None:
+            return
+        patched_version, pocket_versions = result
+        status["patched_version"] = patched_version
+        for pocket, pocket_version in pocket_versions:
+            if status["newest_version"] is None or apt_pkg.version_compare(pocket_version, status["newest_version"]) > 0:
+                status["newest_pocket"], status["newest_version"] = pocket, pocket_version
+
+def newest_upstream_version(result):
+    if result is None:
+        return None
+    newest_version = None
+    for pocket, pocket_version in result[1]:
+        if newest_version is None or apt_pkg.version_compare(pocket_version, newest_version) > 0:
+            newest_version = pocket_version
+    return newest_version
+
+# The Sources indices do not carry publication dates. With --database, the
+# sources-index engine then asks Launchpad for the publications of the Ubuntu
+# versions it found whose date is not recorded yet, one query per version, so
+# the patch lag of a new version is known from the run that finds it. This
+# runs on the main thread, as the database connection belongs to it.
+def date_index_publications(checked_results):
+    dated = set()
+    for (_, component_name, upstream_series_name), result in checked_results.items():
+        if result is None:
+            continue
+        known_versions = set(version for version, _ in observation_store.publication_dates("ubuntu", component_name).get(upstream_series_name, []))
+        for _, version in result[1]:
+            if version in known_versions or (component_name, upstream_series_name, version) in dated:
+                continue
+            if run_deadline_reached():
+                return
+            dated.add((component_name, upstream_series_name, version))
+            upstream_series = get_series(upstream_series_name)
+            def request(session):
+                return list(session.get_entries(session.ubuntu_archive_link, "getPublishedSources", 75,
+                    all_pages=True,
+                    exact_match="true",
+                    source_name=component_name,
+                    version=version,
+                    distro_series=upstream_series.self_link))
+            try:
+                with metrics.call("launchpad.archive.getPublishedSources.dates"):
+                    observe_publications("ubuntu", hedged(request))
+            except Exception as error:
+                print("Failed to find when `%s` %s was published in %s: %s" % (component_name, version, upstream_series_name, error), file=sys.stderr)
+                metrics.count("publication_date_failures")
+
+# Record the whole publishing history, superseded and deleted publications
+# included, of the PPA with one paged query and of every checked package with
+# one query across all the series
+def backfill_history():
+    session = get_launchpad_session()
+    with metrics.call("launchpad.ppa.getPublishedSources.history"):
+        observe_publications("ppa", list(session.get_entries(session.patches_archive_link, "getPublishedSources", ppa_snapshot_page_size,
+            all_pages=True)))
+    for component_name in sorted(set(component_name for _, component_name, _ in packages)):
+        with metrics.call("launchpad.archive.getPublishedSources.history"):
+            observe_publications("ubuntu", list(session.get_entries(session.ubuntu_archive_link, "getPublishedSources", 75,
+                all_pages=True,
+                exact_match="true",
+                source_name=component_name)))
+
+# Outcome of every package of the import lists in a run, for the database
+def package_outcomes(scheduled_packages, checked_results):
+    outcomes = []
+    scheduled_packages = set(scheduled_packages)
+    for package in packages:
+        package_series_name, component_name, upstream_series_name = package
+        patched_version = newest_version = None
+        if (package_series_name, component_name) in failed_packages:
+            outcome = "failed"
+        elif (package_series_name, component_name) in skipped_packages:
+            outcome = "skipped"
+        elif package not in scheduled_packages:
+            outcome = "deferred"
+        elif checked_results.get(package) is None:
+            outcome = "unchanged"
+        else:
+            outcome = "checked"
+            patched_version, newest_version = checked_results[package][0], newest_upstream_version(checked_results[package])
+        outcomes.append(package + (outcome, patched_version, newest_version))
+    return outcomes
+
+def status_report():
+    with status_lock:
+        return dict(run_status, packages=[package_status[key] for key in sorted(package_status)])
+
+class StatusRequestHandler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self):
+        if urllib.parse.urlparse(self.path).path not in ["/", "/status"]:
+            self.send_error(404)
+            return
+        body = (json.dumps(status_report(), indent=2, sort_keys=True) + "\n").encode("utf-8")
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *log_arguments):
+        pass
+
+def start_status_server():
+    server = http.server.ThreadingHTTPServer((args.status_address, args.status_port), StatusRequestHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("Serving the package status on http://%s:%d/" % server.server_address[:2])
+
+# Forget what the previous run found, except for the Launchpad sessions, the
+# series and the caches that are valid between runs
+def start_run():
+    global run_started, run_started_clock, metrics, github_scheduler, ppa_snapshot, open_bot_issues
+    run_started = datetime.datetime.now(datetime.timezone.utc)
+    run_started_clock = time.monotonic()
+    metrics = RunMetrics()
+    github_scheduler = GitHubScheduler()
+    load_incremental_state()
+    ppa_snapshot = None
+    open_bot_issues = None
+    labelled_bot_issues.clear()
+    fused_publications.clear()
+    series_sweeps.clear()
+    sources_index_versions.clear()
+    partial_report_issues.clear()
+    failed_packages.clear()
+    skipped_packages.clear()
+
+def packages_summary(packages):
+    return ", ".join("%s (%s)" % (component_name, package_series_name) for package_series_name, component_name in packages)
+
+failed_packages = []
+skipped_packages = []
+
+# Check every package once, then open the issues and save the caches, the
+# reports and the state of the run
+def run_checks():
+    start_run()
+
+    if args.backfill_history:
+        backfill_history()
+
+    scheduled_packages = packages
+    if args.package_budget is not None:
+        scheduled_packages, deferred_packages = schedule_packages(packages)
+        for _ in deferred_packages:
+            metrics.count("packages_deferred")
+        if deferred_packages:
+            print("Checking %d package(s) within the budget, %d left for the next runs" % (len(scheduled_packages), len(deferred_packages)))
+    set_series_sweep_since(scheduled_packages)
+
+    # Result of every package checked, for its history and the database
+    checked_results = {}
+
+    # In batch mode a failing package is reported and the remaining ones are still checked
+    for package_series_name, component_name, upstream_series_name, check in check_packages(scheduled_packages):
+        if args.import_list is None:
+            try:
+                result = check()
+            except RunDeadlineReached:
+                skip_package(package_series_name, component_name)
+                continue
+            checked_results[(package_series_name, component_name, upstream_series_name)] = result
+            if result is not None:
+                with metrics.package(package_series_name, component_name):
+                    report_package(package_series_name, component_name, upstream_series_name, *result)
+            continue
+
+        print("Checking version for %s in %s" % (component_name, package_series_name))
+        try:
+            result = check()
+            if result is None:
+                print("No new publication of %s since the last run" % (component_name))
+            else:
+                with metrics.package(package_series_name, component_name):
+                    report_package(package_series_name, component_name, upstream_series_name, *result)
+            record_package_status(package_series_name, component_name, upstream_series_name, result)
+            checked_results[(package_series_name, component_name, upstream_series_name)] = result
+        except RunDeadlineReached:
+            skip_package(package_series_name, component_name)
+        except Exception as error:
+            print("Failed to check `%s` in %s: %s" % (component_name, package_series_name, error), file=sys.stderr)
+            failed_packages.append((package_series_name, component_name))
+            metrics.package_failed(package_series_name, component_name)
+            record_package_status(package_series_name, component_name, upstream_series_name, error=str(error))
+
+    if args.merge_reports is not None:
+        merge_partial_reports(args.merge_reports)
+
+    for package_series_name, component_name in github_scheduler.flush_writes():
+        failed_packages.append((package_series_name, component_name))
+        metrics.package_failed(package_series_name, component_name)
+    metrics.github_budget = github_scheduler.budget()
+    github_cache.write()
+
+    if args.cache_max_size is not None:
+        prune_launchpad_cache()
+
+    if query_cache is not None:
+        query_cache.write()
+
+    if observation_store is not None:
+        # --backfill-history already recorded every publication of the packages
+        if args.engine == "sources-index" and not args.backfill_history:
+            date_index_publications(checked_results)
+        observation_store.write_observations()
+        metrics.patch_lag = patch_lags()
+
+    report = metrics.report()
+    if args.stats:
+        checked_packages = sum(len(series_packages) for series_packages in report["packages"].values()) - len(skipped_packages)
+        print("Checked %d package(s) in %.2fs, peak memory %.1f MiB" % (checked_packages,
+            report["seconds"], report["peak_memory_bytes"] / 1024 / 1024), file=sys.stderr)
+        for endpoint, call in sorted(report["calls"].items()):
+            print("  %s: %d call(s) in %.2fs" % (endpoint, call["count"], call["seconds"]), file=sys.stderr)
+
+    if args.report_json is not None:
+        write_report(args.report_json, json.dumps(report, indent=2, sort_keys=True) + "\n")
+
+    if args.report_prometheus is not None:
+        write_report(args.report_prometheus, metrics.prometheus_report())
+
+    if args.partial_report is not None:
+        write_report(args.partial_report, json.dumps({
+            "shard": "%d/%d" % args.shard if args.shard is not None else "1/1",
+            "series": series_names,
+            "issues": partial_report_issues,
+            "failed": failed_packages,
+            "skipped": skipped_packages,
+            "metrics": report,
+        }, indent=2, sort_keys=True) + "\n")
+
+    # Only move the watermark of a series once all its packages have been
+    # checked. The history of the packages checked is kept in any case. The
+    # packages of a shard whose issues are left to the merge step are held
+    # back like failed ones, so they are checked again until the merge has
+    # opened their issues.
+    if args.state_file is not None:
+        pending_packages = [(issue["series"], issue["package"]) for issue in partial_report_issues]
+        held_packages = failed_packages + pending_packages
+        failed_series_names = set(package_series_name for package_series_name, _ in held_packages + skipped_packages)
+        checked_versions = {package: newest_upstream_version(result) for package, result in checked_results.items()
+            if package[:2] not in held_packages}
+        for state_series_name in series_names:
+            series_entries = sorted(set(import_list_entry(component_name, upstream_series_name)
+                for package_series_name, component_name, upstream_series_name in packages if package_series_name == state_series_name))
+            series_state = {
+                "pockets": pockets,
+                "history": updated_history(state_series_name, series_entries, {import_list_entry(component_name, upstream_series_name): version
+                    for (package_series_name, component_name, upstream_series_name), version in checked_versions.items() if package_series_name == state_series_name}),
+            }
+            if state_series_name not in failed_series_names:
+                series_state.update({"since": run_started.isoformat(), "packages": series_entries})
+            elif "since" in previous_series_state(state_series_name):
+                series_state.update({key: previous_series_state(state_series_name)[key] for key in ["since", "packages"]})
+            state[state_series_name] = series_state
+        write_state(state)
+
+    if observation_store is not None:
+        observation_store.write_run(report, package_outcomes(scheduled_packages, checked_results))
+
+    with status_lock:
+        run_status["last_run"] = {
+            "started": report["started"],
+            "seconds": report["seconds"],
+            "failed": [{"series": package_series_name, "package": component_name} for package_series_name, component_name in failed_packages],
+            "skipped": [{"series": package_series_name, "package": component_name} for package_series_name, component_name in skipped_packages],
+        }
+
+    if skipped_packages:
+        print("Run deadline reached, %d package(s) left unchecked: %s" % (len(skipped_packages), packages_summary(skipped_packages)), file=sys.stderr)
+
+# In daemon mode the packages are checked again every --daemon-interval
+# seconds by the same process. Neither a failing package nor a failing run,
+# e.g. one that cannot save its state or reports, stops it: the run is
+# logged and the next one starts at the next interval.
+if args.daemon_interval is None:
+    run_checks()
+    if failed_packages:
+        sys.exit("Failed to check %d package(s): %s" % (len(failed_packages), packages_summary(failed_packages)))
+else:
+    if args.status_port is not None:
+        start_status_server()
+    while True:
+        try:
+            run_checks()
+        except Exception as error:
+            print("Failed to run the checks started at %s: %s" % (run_started.isoformat(), error), file=sys.stderr)
+            traceback.print_exc()
+            with status_lock:
+                run_status["last_run"] = {"started": run_started.isoformat(), "error": str(error)}
+        else:
+            if failed_packages:
+                print("Failed to check %d package(s): %s" % (len(failed_packages), packages_summary(failed_packages)), file=sys.stderr)
+        next_run = run_started + datetime.timedelta(seconds=args.daemon_interval)
+        with status_lock:
+            run_status["next_run"] = next_run.isoformat()
+        time.sleep(max(0.0, (next_run - datetime.datetime.now(datetime.timezone.utc)).total_seconds()))